@@ -13,46 +13,41 @@ static void PrintIndent(int32_t indent)
 
 bool IsEqual(const VMValue& left, const VMValue& right)
 {
-	if ((left.type == TYPE_INT || left.type == TYPE_FLOAT) &&
-		(right.type == TYPE_INT || right.type == TYPE_FLOAT))
+	if (left.IsNumber() && right.IsNumber())
 	{
-		float leftNumber = left.type == TYPE_INT ? (float)left.integer : left.number;
-		float rightNumber = right.type == TYPE_INT ? (float)right.integer : right.number;
-		return leftNumber == rightNumber;
+		return left.AsNumber() == right.AsNumber();
 	}
-	if (left.type != right.type)
+	if (left.IsNil() || right.IsNil())
 	{
-		return false;
+		return left.IsNil() && right.IsNil();
 	}
-	switch (left.type)
+	if (left.IsBool() || right.IsBool())
 	{
-		case TYPE_NIL:
-			return true;
-		case TYPE_BOOL:
-			return left.boolean == right.boolean;
-		case TYPE_STRING:
-			return left.object && right.object &&
-				static_cast<StringValue*>(left.object)->value == static_cast<StringValue*>(right.object)->value;
-		default:
-			return false;
+		return left.IsBool() && right.IsBool() && left.AsBool() == right.AsBool();
+	}
+	// Strings are interned, equal contents mean the same object.
+	if (left.IsObjectType(TYPE_STRING) && right.IsObjectType(TYPE_STRING))
+	{
+		return left.AsObject() == right.AsObject();
 	}
+	return false;
 }
 
 std::string VMValueToString(const VMValue& value)
 {
-	switch (value.type)
+	if (value.IsInt())
 	{
-		case TYPE_INT:
-			return std::to_string(value.integer);
-		case TYPE_FLOAT:
-			return std::to_string(value.number);
-		case TYPE_BOOL:
-			return value.boolean ? "true" : "false";
-		case TYPE_NIL:
-			return "nil";
-		default:
-			return value.object ? static_cast<std::string>(*value.object) : "nil";
+		return std::to_string(value.AsInt());
 	}
+	if (value.IsFloat())
+	{
+		return std::to_string(value.AsFloat());
+	}
+	if (value.IsBool())
+	{
+		return value.AsBool() ? "true" : "false";
+	}
+	return value.IsObject() ? ObjectToString(value.AsObject()) : "nil";
 }
 
 // VMValueArray implementations
@@ -163,6 +158,78 @@ int32_t Chunk::GetColumn(int32_t offset)
 	return columns[offset];
 }
 
+int32_t Chunk::GetInstructionSize(int32_t offset) const
+{
+	switch (code[offset])
+	{
+		case OP_CONSTANT:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_CLASS_METHOD:
+		case OP_INNER_INVOKE:
+			return 2;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			return 4;
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_SET_PROPERTY:
+		case OP_GET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_ROOT_INVOKE:
+		case OP_ADD_LOCALS:
+		case OP_INC_LOCAL:
+		case OP_MOVE:
+		case OP_LOAD_CONSTANT:
+			return 3;
+		case OP_CONSTANT_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_GET_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:
+		case OP_GET_LOCAL_LONG:
+		case OP_SET_LOCAL_LONG:
+		case OP_METHOD_LONG:
+		case OP_CLASS_METHOD_LONG:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_GET_LOCAL_PROPERTY:
+		case OP_ADD_RRR:
+		case OP_SUBTRACT_RRR:
+		case OP_MULTIPLY_RRR:
+		case OP_DIVIDE_RRR:
+		case OP_ADD_RRK:
+		case OP_SUBTRACT_RRK:
+		case OP_MULTIPLY_RRK:
+		case OP_DIVIDE_RRK:
+			return 4;
+		case OP_ROOT_INVOKE_LONG:
+		case OP_LT_LOCAL_CONST_JUMP:
+		case OP_LESS_JUMP_RR:
+		case OP_SET_PROPERTY_RR:
+			return 5;
+		case OP_SET_PROPERTY_LONG:
+		case OP_GET_PROPERTY_LONG:
+		case OP_GET_SUPER_LONG:
+			return 7;
+		case OP_INVOKE_LONG:
+		case OP_SUPER_INVOKE_LONG:
+			return 8;
+		case OP_CLOSURE:
+			// Each captured upvalue is encoded as an (isLocal, index) pair.
+			return 2 + 2 * code[offset + 1];
+		default:
+			return 1;
+	}
+}
+
 int32_t Chunk::AddConstant(VMValue value)
 {
 	for (int32_t i = 0; i < constants.count; ++i)
@@ -236,6 +303,98 @@ int32_t Chunk::JumpInstruction(const char* name, int32_t sign, int32_t offset)
 	return offset + 3;
 }
 
+int32_t Chunk::LocalPairInstruction(const char* name, int32_t offset)
+{
+	uint8_t first = code[offset + 1];
+	uint8_t second = code[offset + 2];
+	printf("%-16s %4d %4d\n", name, first, second);
+	return offset + 3;
+}
+
+int32_t Chunk::CallInstruction(const char* name, int32_t offset)
+{
+	uint8_t argCount = code[offset + 1];
+	uint16_t cacheIndex = (uint16_t)((code[offset + 2] << 8) | code[offset + 3]);
+	printf("%-16s %4d cache %d\n", name, argCount, cacheIndex);
+	return offset + 4;
+}
+
+int32_t Chunk::LocalConstantInstruction(const char* name, int32_t offset)
+{
+	uint8_t slot = code[offset + 1];
+	uint8_t constant = code[offset + 2];
+	printf("%-16s %4d '", name, slot);
+	PrintValue(constants.values[constant]);
+	printf("'\n");
+	return offset + 3;
+}
+
+int32_t Chunk::LocalPropertyInstruction(const char* name, int32_t offset)
+{
+	uint8_t slot = code[offset + 1];
+	uint8_t nameIndex = code[offset + 2];
+	uint8_t cacheIndex = code[offset + 3];
+	printf("%-16s %4d '", name, slot);
+	PrintValue(constants.values[nameIndex]);
+	printf("' cache %u\n", cacheIndex);
+	return offset + 4;
+}
+
+int32_t Chunk::LocalConstantJumpInstruction(const char* name, int32_t offset)
+{
+	uint8_t slot = code[offset + 1];
+	uint8_t constant = code[offset + 2];
+	int32_t jump = (int32_t)((code[offset + 3] << 8) | code[offset + 4]);
+	printf("%-16s %4d '", name, slot);
+	PrintValue(constants.values[constant]);
+	printf("' -> %d\n", offset + 5 + jump);
+	return offset + 5;
+}
+
+int32_t Chunk::RegisterInstruction(const char* name, int32_t offset, int32_t registerCount)
+{
+	printf("%-16s", name);
+	for (int32_t i = 1; i <= registerCount; ++i)
+	{
+		printf(" r%-3d", code[offset + i]);
+	}
+	printf("\n");
+	return offset + 1 + registerCount;
+}
+
+int32_t Chunk::RegisterConstantInstruction(const char* name, int32_t offset)
+{
+	// The constant is always the last operand.
+	int32_t registerCount = code[offset] == OP_LOAD_CONSTANT ? 1 : 2;
+	printf("%-16s", name);
+	for (int32_t i = 1; i <= registerCount; ++i)
+	{
+		printf(" r%-3d", code[offset + i]);
+	}
+	printf(" '");
+	PrintValue(constants.values[code[offset + 1 + registerCount]]);
+	printf("'\n");
+	return offset + 2 + registerCount;
+}
+
+int32_t Chunk::RegisterJumpInstruction(const char* name, int32_t offset)
+{
+	int32_t jump = (int32_t)((code[offset + 3] << 8) | code[offset + 4]);
+	printf("%-16s r%-3d r%-3d -> %d\n", name, code[offset + 1], code[offset + 2], offset + 5 + jump);
+	return offset + 5;
+}
+
+int32_t Chunk::RegisterPropertyInstruction(const char* name, int32_t offset)
+{
+	// object, name, value, cache.
+	uint8_t nameIndex = code[offset + 2];
+	uint8_t cacheIndex = code[offset + 4];
+	printf("%-16s r%-3d '", name, code[offset + 1]);
+	PrintValue(constants.values[nameIndex]);
+	printf("' r%-3d cache %u\n", code[offset + 3], cacheIndex);
+	return offset + 5;
+}
+
 void Chunk::PrintValue(VMValue value)
 {
 	std::string s = VMValueToString(value);
@@ -391,20 +550,78 @@ int32_t Chunk::DisassembleInstruction(int32_t offset, int32_t indent)
 			return SimpleInstruction("OP_MULTIPLY", offset);
 		case OP_DIVIDE:
 			return SimpleInstruction("OP_DIVIDE", offset);
+		case OP_ADD_II:
+			return SimpleInstruction("OP_ADD_II", offset);
+		case OP_ADD_FF:
+			return SimpleInstruction("OP_ADD_FF", offset);
+		case OP_ADD_SS:
+			return SimpleInstruction("OP_ADD_SS", offset);
+		case OP_SUBTRACT_II:
+			return SimpleInstruction("OP_SUBTRACT_II", offset);
+		case OP_SUBTRACT_FF:
+			return SimpleInstruction("OP_SUBTRACT_FF", offset);
+		case OP_MULTIPLY_II:
+			return SimpleInstruction("OP_MULTIPLY_II", offset);
+		case OP_MULTIPLY_FF:
+			return SimpleInstruction("OP_MULTIPLY_FF", offset);
+		case OP_GREATER_II:
+			return SimpleInstruction("OP_GREATER_II", offset);
+		case OP_GREATER_FF:
+			return SimpleInstruction("OP_GREATER_FF", offset);
+		case OP_LESS_II:
+			return SimpleInstruction("OP_LESS_II", offset);
+		case OP_LESS_FF:
+			return SimpleInstruction("OP_LESS_FF", offset);
+		case OP_ADD_LOCALS:
+			return LocalPairInstruction("OP_ADD_LOCALS", offset);
+		case OP_INC_LOCAL:
+			return LocalConstantInstruction("OP_INC_LOCAL", offset);
+		case OP_GET_LOCAL_PROPERTY:
+			return LocalPropertyInstruction("OP_GET_LOCAL_PROPERTY", offset);
+		case OP_LT_LOCAL_CONST_JUMP:
+			return LocalConstantJumpInstruction("OP_LT_LOCAL_CONST_JUMP", offset);
+		case OP_LESS_EQUAL:
+			return SimpleInstruction("OP_LESS_EQUAL", offset);
+		case OP_GREATER_EQUAL:
+			return SimpleInstruction("OP_GREATER_EQUAL", offset);
+		case OP_MOVE:
+			return RegisterInstruction("OP_MOVE", offset, 2);
+		case OP_LOAD_CONSTANT:
+			return RegisterConstantInstruction("OP_LOAD_CONSTANT", offset);
+		case OP_ADD_RRR:
+			return RegisterInstruction("OP_ADD_RRR", offset, 3);
+		case OP_SUBTRACT_RRR:
+			return RegisterInstruction("OP_SUBTRACT_RRR", offset, 3);
+		case OP_MULTIPLY_RRR:
+			return RegisterInstruction("OP_MULTIPLY_RRR", offset, 3);
+		case OP_DIVIDE_RRR:
+			return RegisterInstruction("OP_DIVIDE_RRR", offset, 3);
+		case OP_ADD_RRK:
+			return RegisterConstantInstruction("OP_ADD_RRK", offset);
+		case OP_SUBTRACT_RRK:
+			return RegisterConstantInstruction("OP_SUBTRACT_RRK", offset);
+		case OP_MULTIPLY_RRK:
+			return RegisterConstantInstruction("OP_MULTIPLY_RRK", offset);
+		case OP_DIVIDE_RRK:
+			return RegisterConstantInstruction("OP_DIVIDE_RRK", offset);
+		case OP_LESS_JUMP_RR:
+			return RegisterJumpInstruction("OP_LESS_JUMP_RR", offset);
+		case OP_SET_PROPERTY_RR:
+			return RegisterPropertyInstruction("OP_SET_PROPERTY_RR", offset);
 		case OP_NOT:
 			return SimpleInstruction("OP_NOT", offset);
 		case OP_DEFINE_GLOBAL:
-			return ConstantInstruction("OP_DEFINE_GLOBAL", offset);
+			return ByteInstruction("OP_DEFINE_GLOBAL", offset);
 		case OP_DEFINE_GLOBAL_LONG:
-			return ConstantLongInstruction("OP_DEFINE_GLOBAL_LONG", offset);
+			return ThreeByteInstruction("OP_DEFINE_GLOBAL_LONG", offset);
 		case OP_GET_GLOBAL:
-			return ConstantInstruction("OP_GET_GLOBAL", offset);
+			return ByteInstruction("OP_GET_GLOBAL", offset);
 		case OP_GET_GLOBAL_LONG:
-			return ConstantLongInstruction("OP_GET_GLOBAL_LONG", offset);
+			return ThreeByteInstruction("OP_GET_GLOBAL_LONG", offset);
 		case OP_SET_GLOBAL:
-			return ConstantInstruction("OP_SET_GLOBAL", offset);
+			return ByteInstruction("OP_SET_GLOBAL", offset);
 		case OP_SET_GLOBAL_LONG:
-			return ConstantLongInstruction("OP_SET_GLOBAL_LONG", offset);
+			return ThreeByteInstruction("OP_SET_GLOBAL_LONG", offset);
 		case OP_GET_LOCAL:
 			return ByteInstruction("OP_GET_LOCAL", offset);
 		case OP_GET_LOCAL_LONG:
@@ -434,7 +651,9 @@ int32_t Chunk::DisassembleInstruction(int32_t offset, int32_t indent)
 		case OP_LOOP:
 			return JumpInstruction("OP_LOOP", -1, offset);
 		case OP_CALL:
-			return ByteInstruction("OP_CALL", offset);
+			return CallInstruction("OP_CALL", offset);
+		case OP_TAIL_CALL:
+			return CallInstruction("OP_TAIL_CALL", offset);
 		case OP_CLOSURE:
 			return ClosureInstruction("OP_CLOSURE", offset, indent);
 		case OP_GET_UPVALUE:
@@ -2,6 +2,7 @@
 #include "Value.h"
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <type_traits>
 #include <utility>
 
@@ -19,6 +20,7 @@ enum OpCode
 	OP_MULTIPLY,
 	OP_DIVIDE,
 	OP_NOT,
+	// Global opcodes take a VM global slot index, resolved from the name by the compiler.
 	OP_DEFINE_GLOBAL,
 	OP_DEFINE_GLOBAL_LONG,
 	OP_GET_LOCAL,
@@ -64,6 +66,42 @@ enum OpCode
 	OP_GET_SUPER_LONG,
 	OP_SUPER_INVOKE,
 	OP_SUPER_INVOKE_LONG,
+	// Quickened forms of the arithmetic opcodes, only written by the VM once a site has seen its operand types.
+	OP_ADD_II,
+	OP_ADD_FF,
+	OP_ADD_SS,
+	OP_SUBTRACT_II,
+	OP_SUBTRACT_FF,
+	OP_MULTIPLY_II,
+	OP_MULTIPLY_FF,
+	OP_GREATER_II,
+	OP_GREATER_FF,
+	OP_LESS_II,
+	OP_LESS_FF,
+	// Superinstructions written by the compiler's peephole pass.
+	OP_ADD_LOCALS,
+	OP_INC_LOCAL,
+	OP_LT_LOCAL_CONST_JUMP,
+	OP_LESS_EQUAL,
+	OP_GREATER_EQUAL,
+	OP_GET_LOCAL_PROPERTY,
+	// Three-address superinstructions, operands name frame slots directly.
+	OP_MOVE,
+	OP_LOAD_CONSTANT,
+	// The RRR and RRK groups keep the OP_ADD..OP_DIVIDE order.
+	OP_ADD_RRR,
+	OP_SUBTRACT_RRR,
+	OP_MULTIPLY_RRR,
+	OP_DIVIDE_RRR,
+	OP_ADD_RRK,
+	OP_SUBTRACT_RRK,
+	OP_MULTIPLY_RRK,
+	OP_DIVIDE_RRK,
+	OP_LESS_JUMP_RR,
+	OP_SET_PROPERTY_RR,
+	// A call in tail position, always followed by OP_RETURN for callees that cannot take over the frame.
+	// Shares OP_CALL's operands: argument count and a 16 bit call cache index.
+	OP_TAIL_CALL,
 	OP_RETURN,
 };
 
@@ -122,7 +160,100 @@ void free_array_impl(T* pointer, size_t old_count)
 #define FREE_ARRAY(type, pointer, oldCount) free_array_impl(pointer, oldCount)
 
 struct Chunk;
+struct Shape;
 
+// Pack every VMValue into 64 bits by hiding non-float payloads inside quiet NaNs.
+// Comment out to fall back to the tagged union representation.
+#define NAN_BOXING
+
+#ifdef NAN_BOXING
+struct VMValue
+{
+	// A double is a quiet NaN when all exponent bits and the quiet bit are set.
+	// Objects additionally set the sign bit and keep the pointer in the low 48 bits.
+	// Ints set bit 49 and keep the 32 bit payload in the low bits.
+	// The remaining singletons (nil, false, true, empty) use small tags in the low bits.
+	static constexpr uint64_t SIGN_BIT = 0x8000000000000000ull;
+	static constexpr uint64_t QNAN = 0x7ffc000000000000ull;
+	static constexpr uint64_t INT_TAG = 0x0002000000000000ull;
+	static constexpr uint64_t TAG_EMPTY = 0;
+	static constexpr uint64_t TAG_NIL = 1;
+	static constexpr uint64_t TAG_FALSE = 2;
+	static constexpr uint64_t TAG_TRUE = 3;
+	// Canonical NaN produced by float arithmetic, never collides with a tagged value.
+	static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000ull;
+
+	uint64_t bits;
+
+	VMValue()
+		: bits(QNAN | TAG_EMPTY)
+	{}
+	VMValue(VMObject* inObject)
+		: bits(inObject ? (SIGN_BIT | QNAN | (uint64_t)(uintptr_t)inObject) : (QNAN | TAG_EMPTY))
+	{}
+	VMValue(bool inBoolean)
+		: bits(QNAN | (inBoolean ? TAG_TRUE : TAG_FALSE))
+	{}
+	VMValue(int inInteger)
+		: bits(QNAN | INT_TAG | (uint32_t)inInteger)
+	{}
+	VMValue(float inNumber)
+	{
+		double number = inNumber;
+		if (number != number)
+		{
+			bits = CANONICAL_NAN;
+		}
+		else
+		{
+			memcpy(&bits, &number, sizeof(bits));
+		}
+	}
+
+	static VMValue Nil()
+	{
+		VMValue value;
+		value.bits = QNAN | TAG_NIL;
+		return value;
+	}
+
+	bool IsFloat() const { return (bits & QNAN) != QNAN; }
+	bool IsInt() const { return (bits & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG); }
+	bool IsNumber() const { return IsFloat() || IsInt(); }
+	bool IsBool() const { return (bits | 1) == (QNAN | TAG_TRUE); }
+	bool IsNil() const { return bits == (QNAN | TAG_NIL); }
+	bool IsObject() const { return (bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN); }
+	bool IsValid() const { return bits != (QNAN | TAG_EMPTY); }
+	bool IsObjectType(ValueType inType) const { return IsObject() && AsObject()->type == inType; }
+
+	int AsInt() const { return (int)(uint32_t)bits; }
+	float AsFloat() const
+	{
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		return (float)number;
+	}
+	float AsNumber() const { return IsInt() ? (float)AsInt() : AsFloat(); }
+	bool AsBool() const { return bits == (QNAN | TAG_TRUE); }
+	VMObject* AsObject() const { return IsObject() ? (VMObject*)(uintptr_t)(bits & ~(SIGN_BIT | QNAN)) : nullptr; }
+
+	ValueType GetType() const
+	{
+		if (IsFloat()) return TYPE_FLOAT;
+		if (IsInt()) return TYPE_INT;
+		if (IsObject()) return AsObject()->type;
+		if (IsNil()) return TYPE_NIL;
+		if (IsBool()) return TYPE_BOOL;
+		return TYPE_ERROR;
+	}
+
+	Chunk* GetChunk() const
+	{
+		return IsObject() ? ObjectChunk(AsObject()) : nullptr;
+	}
+};
+static_assert(sizeof(VMValue) == 8, "NaN boxed VMValue must fit in 64 bits.");
+#else
 struct VMValue
 {
 	ValueType type;
@@ -131,13 +262,13 @@ struct VMValue
 		bool boolean;
 		int integer;
 		float number;
-		Value* object;
+		VMObject* object;
 	};
 	VMValue()
 		: type(TYPE_ERROR)
 		, object(nullptr)
 	{}
-	VMValue(Value* inObject)
+	VMValue(VMObject* inObject)
 		: type(inObject ? inObject->type : TYPE_ERROR)
 		, object(inObject)
 	{}
@@ -161,21 +292,35 @@ struct VMValue
 		return value;
 	}
 
+	bool IsFloat() const { return type == TYPE_FLOAT; }
+	bool IsInt() const { return type == TYPE_INT; }
+	bool IsNumber() const { return type == TYPE_INT || type == TYPE_FLOAT; }
+	bool IsBool() const { return type == TYPE_BOOL; }
+	bool IsNil() const { return type == TYPE_NIL; }
 	bool IsObject() const
 	{
 		return type != TYPE_INT && type != TYPE_FLOAT && type != TYPE_BOOL && type != TYPE_NIL;
 	}
-
 	bool IsValid() const
 	{
 		return type != TYPE_ERROR || object != nullptr;
 	}
+	bool IsObjectType(ValueType inType) const { return type == inType && object != nullptr; }
+
+	int AsInt() const { return integer; }
+	float AsFloat() const { return number; }
+	float AsNumber() const { return type == TYPE_INT ? (float)integer : number; }
+	bool AsBool() const { return boolean; }
+	VMObject* AsObject() const { return IsObject() ? object : nullptr; }
+
+	ValueType GetType() const { return type; }
 
 	Chunk* GetChunk() const
 	{
-		return IsObject() && object ? object->GetChunk() : nullptr;
+		return IsObject() && object ? ObjectChunk(object) : nullptr;
 	}
 };
+#endif
 
 bool IsEqual(const VMValue& left, const VMValue& right);
 std::string VMValueToString(const VMValue& value);
@@ -195,38 +340,52 @@ struct InlineCache
 {
 	static constexpr uint32_t ENTRY_COUNT = 4;
 
+	// Entries are keyed by an instance's shape id, or a class id at super sites, ids are never reused,
+	// so entries of a freed class simply stop matching. Shape ids come from the class id counter.
 	struct Entry
 	{
-		void* klass;
-		uint32_t slotNum;
+		uint64_t id;
 		uint32_t slot;
 		VMValue method;
+		// Stores of a field the instance lacks: the shape that adding the field moves it to.
+		Shape* transition;
 	} entries[ENTRY_COUNT];
 
 	uint32_t writeLocation;
 
+	// OP_CALL sites remember the last closure they entered and what its frame needs.
+	// The closure's address may be reused once it is freed, so the entry is only valid in the closure epoch it was filled in.
+	void* callee;
+	Chunk* calleeChunk;
+	int32_t calleeStackSize;
+	uint64_t calleeEpoch;
+
 	InlineCache()
 		: writeLocation(0)
+		, callee(nullptr)
+		, calleeChunk(nullptr)
+		, calleeStackSize(0)
+		, calleeEpoch(0)
 	{
 		for (uint32_t i = 0; i < ENTRY_COUNT; ++i)
 		{
-			entries[i].klass = nullptr;
-			entries[i].slotNum = 0;
+			entries[i].id = 0;
 			entries[i].slot = -1;
 			entries[i].method = VMValue();
+			entries[i].transition = nullptr;
 		}
 	}
 
-	const Entry* Match(void* inKlass, uint32_t inSlotNum) const
+	const Entry* Match(uint64_t inId) const
 	{
-		if (!inKlass)
+		if (inId == 0)
 		{
 			return nullptr;
 		}
 		for (uint32_t i = 0; i < ENTRY_COUNT; ++i)
 		{
 			uint32_t index = (ENTRY_COUNT + writeLocation - 1 - i) % ENTRY_COUNT;
-			if (entries[index].klass == inKlass && entries[index].slotNum == inSlotNum)
+			if (entries[index].id == inId)
 			{
 				return &entries[index];
 			}
@@ -234,12 +393,12 @@ struct InlineCache
 		return nullptr;
 	}
 
-	void Update(void* inKlass, uint32_t inSlotNum, uint32_t inSlot, VMValue inMethod)
+	void Update(uint64_t inId, uint32_t inSlot, VMValue inMethod, Shape* inTransition = nullptr)
 	{
-		entries[writeLocation].klass = inKlass;
-		entries[writeLocation].slotNum = inSlotNum;
+		entries[writeLocation].id = inId;
 		entries[writeLocation].slot = inSlot;
 		entries[writeLocation].method = inMethod;
+		entries[writeLocation].transition = inTransition;
 		writeLocation = (writeLocation + 1) % ENTRY_COUNT;
 	}
 };
@@ -281,6 +440,8 @@ struct Chunk
 	int32_t GetColumn(int32_t offset);
 
 	inline int32_t GetSize() const { return count; }
+	// Size in bytes of the instruction at offset, including its operands.
+	int32_t GetInstructionSize(int32_t offset) const;
 
 	int32_t AddConstant(VMValue value);
 	void Free();
@@ -291,6 +452,15 @@ struct Chunk
 	int32_t ByteInstruction(const char* name, int32_t offset);
 	int32_t ThreeByteInstruction(const char* name, int32_t offset);
 	int32_t JumpInstruction(const char* name, int32_t sign, int32_t offset);
+	int32_t LocalPairInstruction(const char* name, int32_t offset);
+	int32_t CallInstruction(const char* name, int32_t offset);
+	int32_t LocalConstantInstruction(const char* name, int32_t offset);
+	int32_t LocalPropertyInstruction(const char* name, int32_t offset);
+	int32_t LocalConstantJumpInstruction(const char* name, int32_t offset);
+	int32_t RegisterInstruction(const char* name, int32_t offset, int32_t registerCount);
+	int32_t RegisterConstantInstruction(const char* name, int32_t offset);
+	int32_t RegisterJumpInstruction(const char* name, int32_t offset);
+	int32_t RegisterPropertyInstruction(const char* name, int32_t offset);
 	static void PrintValue(VMValue value);
 	static void PrintValueStdout(VMValue value);
 	int32_t ConstantInstruction(const char* name, int32_t offset);
@@ -1,5 +1,7 @@
 #include "Compiler.h"
 #include "VM.h"
+#include <cassert>
+#include <new>
 
 #define DEBUG_PRINT_CODE
 
@@ -52,6 +54,18 @@ Chunk* Compiler::CurrentChunk()
 
 void Compiler::VMFunctionBase::Blacken(VM& vm)
 {
+	switch (functionType)
+	{
+		case VM_FUNC_CLOSURE:
+			static_cast<VMClosureValue*>(this)->Blacken(vm);
+			return;
+		case VM_FUNC_METHOD:
+			static_cast<BoundMethodValue*>(this)->Blacken(vm);
+			return;
+		default:
+			break;
+	}
+	// Functions own their chunk, so its constants are theirs to keep alive.
 	Chunk* chunk = GetChunk();
 	if (chunk == nullptr)
 	{
@@ -63,107 +77,197 @@ void Compiler::VMFunctionBase::Blacken(VM& vm)
 	}
 }
 
-void Compiler::VMClosureValue::Blacken(VM& vm)
+size_t Compiler::VMFunctionBase::Size() const
 {
-	vm.MarkValue(function);
-	for (const VMValue& upvalue : upvalues)
+	switch (functionType)
 	{
-		vm.MarkValue(upvalue);
+		case VM_FUNC_SCRIPT:
+			return static_cast<const ScriptFunction*>(this)->Size();
+		case VM_FUNC_FUNCTION:
+			return static_cast<const VMFunctionValue*>(this)->Size();
+		case VM_FUNC_NATIVE:
+			return static_cast<const NativeFunctionValue*>(this)->Size();
+		case VM_FUNC_CLOSURE:
+			return static_cast<const VMClosureValue*>(this)->Size();
+		case VM_FUNC_METHOD:
+			return static_cast<const BoundMethodValue*>(this)->Size();
 	}
+	return sizeof(*this);
 }
 
-uint32_t Compiler::VMClassValue::GetSlot(const std::string& fieldName) const
+std::string Compiler::VMFunctionBase::ToString() const
 {
-	auto it = fieldToSlot.find(fieldName);
-	if (it != fieldToSlot.end())
+	switch (functionType)
 	{
-		return it->second;
+		case VM_FUNC_SCRIPT:
+			return static_cast<const ScriptFunction*>(this)->ToString();
+		case VM_FUNC_FUNCTION:
+			return static_cast<const VMFunctionValue*>(this)->ToString();
+		case VM_FUNC_NATIVE:
+			return static_cast<const NativeFunctionValue*>(this)->ToString();
+		case VM_FUNC_CLOSURE:
+			return static_cast<const VMClosureValue*>(this)->ToString();
+		case VM_FUNC_METHOD:
+			return static_cast<const BoundMethodValue*>(this)->ToString();
 	}
-	return INVALID_SLOT;
+	return "";
 }
 
-uint32_t Compiler::VMClassValue::GetOrCreateSlot(const std::string& fieldName)
+void Compiler::VMFunctionBase::Destroy()
 {
-	auto it = fieldToSlot.find(fieldName);
-	if (it != fieldToSlot.end())
+	switch (functionType)
 	{
-		return it->second;
+		case VM_FUNC_SCRIPT:
+			delete static_cast<ScriptFunction*>(this);
+			break;
+		case VM_FUNC_FUNCTION:
+			delete static_cast<VMFunctionValue*>(this);
+			break;
+		case VM_FUNC_NATIVE:
+			delete static_cast<NativeFunctionValue*>(this);
+			break;
+		case VM_FUNC_CLOSURE:
+			delete static_cast<VMClosureValue*>(this);
+			break;
+		case VM_FUNC_METHOD:
+			delete static_cast<BoundMethodValue*>(this);
+			break;
 	}
-	return fieldToSlot[fieldName] = slotNum++;
 }
 
-VMValue Compiler::VMClassValue::FindDirectMethod(const std::string& methodName) const
+void Compiler::VMClosureValue::Blacken(VM& vm)
 {
-	auto it = methods.find(methodName);
-	if (it != methods.end())
+	vm.MarkValue(function);
+	for (const VMValue& upvalue : upvalues)
 	{
-		return it->second;
+		vm.MarkValue(upvalue);
 	}
-	return VMValue();
 }
 
-VMValue Compiler::VMClassValue::FindMethod(const std::string& methodName) const
+uint64_t Compiler::VMClassValue::nextClassId = 1;
+
+Shape* Compiler::VMClassValue::Transition(Shape* from, VMStringValue* fieldName)
 {
-	VMValue method = FindDirectMethod(methodName);
-	if (method.object)
+	Shape* const* next = from->transitions.Find(fieldName);
+	if (next)
 	{
-		return method;
+		return *next;
 	}
-	if (superClass.object)
+	VM& vm = VM::GetInstance();
+	if (!vm.ChargeGrowth(this, sizeof(Shape)))
 	{
-		VMClassValue* superClassObj = static_cast<VMClassValue*>(superClass.object);
-		return superClassObj->FindMethod(methodName);
+		return nullptr;
 	}
-	return VMValue();
+	shapes.push_back(std::make_unique<Shape>(nextClassId++, from, fieldName));
+	Shape* shape = shapes.back().get();
+	from->transitions.Set(fieldName, shape);
+	inlineFieldCount = std::max(inlineFieldCount, std::min(shape->fieldCount, MAX_INLINE_FIELDS));
+	// The shapes keep their names alive, they are weak in the intern table.
+	vm.WriteBarrier(this, VMValue(fieldName));
+	return shape;
 }
 
-VMValue Compiler::VMClassValue::FindClassMethod(const std::string& methodName) const
+VMValue Compiler::VMClassValue::FindDirectMethod(const VMStringValue* methodName) const
 {
-	auto it = classMethods.find(methodName);
-	if (it != classMethods.end())
-	{
-		return it->second;
-	}
-	return VMValue();
+	const Method* method = methods.Find(methodName);
+	return method && !method->inherited ? method->method : VMValue();
 }
 
-void Compiler::VMInstanceValue::SetField(uint32_t slotIndex, VMValue value)
+VMValue Compiler::VMClassValue::FindMethod(const VMStringValue* methodName) const
 {
-	auto NextPowOfTwo = [](uint32_t value)
-	{
-		uint32_t ret = 1;
-		while (ret <= value) ret *= 2;
-		return ret;
-	};
+	const Method* method = methods.Find(methodName);
+	return method ? method->method : VMValue();
+}
 
-	if (slotIndex >= fields.size())
-	{
-		uint32_t targetSize = std::max(8U, NextPowOfTwo(slotIndex));
-		fields.resize(targetSize);
-	}
-	fields[slotIndex] = value;
+VMValue Compiler::VMClassValue::FindClassMethod(const VMStringValue* methodName) const
+{
+	const VMValue* method = classMethods.Find(methodName);
+	return method ? *method : VMValue();
+}
+
+void Compiler::VMClassValue::SetMethod(VMStringValue* methodName, VMValue method)
+{
+	methods.Set(methodName, Method{ method, false });
+	VM& vm = VM::GetInstance();
+	vm.WriteBarrier(this, VMValue(methodName));
+	vm.WriteBarrier(this, method);
+}
+
+void Compiler::VMClassValue::SetClassMethod(VMStringValue* methodName, VMValue method)
+{
+	classMethods.Set(methodName, method);
+	VM& vm = VM::GetInstance();
+	vm.WriteBarrier(this, VMValue(methodName));
+	vm.WriteBarrier(this, method);
+}
+
+void Compiler::VMClassValue::Inherit(VMClassValue* superClassValue)
+{
+	VM& vm = VM::GetInstance();
+	superClass = VMValue(superClassValue);
+	vm.WriteBarrier(this, superClass);
+	superClassValue->methods.ForEach([&](VMStringValue* methodName, const Method& method) {
+		methods.Set(methodName, Method{ method.method, true });
+		vm.WriteBarrier(this, VMValue(methodName));
+		vm.WriteBarrier(this, method.method);
+	});
+}
+
+Compiler::VMInstanceValue* Compiler::VMInstanceValue::New(VMValue inClass)
+{
+	uint32_t inlineCapacity = static_cast<VMClassValue*>(inClass.AsObject())->inlineFieldCount;
+	void* memory = ValueArena::GetInstance().Allocate(AllocationSize(inlineCapacity));
+	return ::new (memory) VMInstanceValue(inClass, inlineCapacity);
 }
 
-VMValue Compiler::VMInstanceValue::GetField(uint32_t slotIndex)
+void Compiler::VMInstanceValue::Destroy()
 {
-	if (slotIndex < fields.size())
+	size_t size = AllocationSize(inlineCapacity);
+	this->~VMInstanceValue();
+	ValueArena::GetInstance().Free(this, size);
+}
+
+Compiler::VMInstanceValue::~VMInstanceValue()
+{
+	FREE_ARRAY(VMValue, overflow, overflowCapacity);
+}
+
+bool Compiler::VMInstanceValue::AddField(Shape* next, VMValue value)
+{
+	uint32_t slotIndex = shape->fieldCount;
+	if (slotIndex >= inlineCapacity + overflowCapacity)
 	{
-		return fields[slotIndex];
+		uint32_t oldCapacity = overflowCapacity;
+		uint32_t newCapacity = GROW_CAPACITY(oldCapacity);
+		if (!VM::GetInstance().ChargeGrowth(this, (newCapacity - oldCapacity) * sizeof(VMValue)))
+		{
+			return false;
+		}
+		overflow = GROW_ARRAY(VMValue, overflow, oldCapacity, newCapacity);
+		overflowCapacity = newCapacity;
 	}
-	return VMValue();
+	SetField(slotIndex, value);
+	shape = next;
+	return true;
 }
 
 void Compiler::VMClassValue::Blacken(VM& vm)
 {
 	vm.MarkValue(superClass);
-	for (const auto& method : methods)
-	{
-		vm.MarkValue(method.second);
-	}
-	for (const auto& method : classMethods)
+	vm.MarkValue(initializer);
+	// Names are marked too, the intern table does not keep them alive.
+	for (size_t i = 1; i < shapes.size(); ++i)
 	{
-		vm.MarkValue(method.second);
+		vm.MarkValue(VMValue(shapes[i]->name));
 	}
+	methods.ForEach([&](VMStringValue* methodName, const Method& method) {
+		vm.MarkValue(VMValue(methodName));
+		vm.MarkValue(method.method);
+	});
+	classMethods.ForEach([&](VMStringValue* methodName, const VMValue& method) {
+		vm.MarkValue(VMValue(methodName));
+		vm.MarkValue(method);
+	});
 }
 
 void Compiler::BoundMethodValue::Blacken(VM& vm)
@@ -175,9 +279,9 @@ void Compiler::BoundMethodValue::Blacken(VM& vm)
 void Compiler::VMInstanceValue::Blacken(VM& vm)
 {
 	vm.MarkValue(classValue);
-	for (const auto& value : fields)
+	for (uint32_t i = 0; i < shape->fieldCount; ++i)
 	{
-		vm.MarkValue(value);
+		vm.MarkValue(GetField(i));
 	}
 }
 
@@ -396,7 +500,7 @@ VMValue Compiler::CompileFunction(FunctionType fnType, const std::string& name)
 
 	BeginScope();
 
-	VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(function.object);
+	VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(function.AsObject());
 
 	// Token consumption here uses *this* (the enclosing compiler) — since
 	// sub shares ctx, nextToken advances for both simultaneously.
@@ -435,7 +539,7 @@ void Compiler::EmitClosure(const Compiler& compiler)
 	EmitByte(OP_CLOSURE);
 	if (compiler.type != TYPE_SCRIPT)
 	{
-		VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(compiler.function.object);
+		VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(compiler.function.AsObject());
 		EmitByte(fnValue->upvalueCount);
 		for (int32_t i = 0; i < fnValue->upvalueCount; i++)
 		{
@@ -456,7 +560,7 @@ void Compiler::Function(FunctionType fnType, const std::string& name)
 	Compiler sub(this, ctx);
 	VMValue fn = sub.CompileFunction(fnType, name);
 
-	if (fn.object == nullptr)
+	if (fn.AsObject() == nullptr)
 	{
 		// Sub-compiler encountered an error, bail out to avoid dereferencing null.
 		return;
@@ -471,7 +575,7 @@ VMValue Compiler::CompileGetter(const std::string& name)
 
 	BeginScope();
 
-	VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(function.object);
+	VMFunctionValue* fnValue = static_cast<VMFunctionValue*>(function.AsObject());
 
 	Consume(LEFT_BRACE, "Expect '{' before getter body.");
 	Block();
@@ -490,7 +594,7 @@ void Compiler::Getter(const std::string& name)
 	// ParseContext so both advance through the same token stream.
 	Compiler sub(this, ctx);
 	VMValue fn = sub.CompileGetter(name);
-	if (fn.object == nullptr)
+	if (fn.AsObject() == nullptr)
 	{
 		// Sub-compiler encountered an error, bail out to avoid dereferencing null.
 		return;
@@ -506,12 +610,13 @@ void Compiler::ClassDeclaration()
 
 	Consume(IDENTIFIER, "Expect class name.");
 	uint32_t nameConstant = IdentifierConstant(parser.previous);
+	uint32_t global = scopeDepth > 0 ? UINT8_MAX : GlobalSlot(parser.previous);
 
 	DeclareVariable(false);
 	// Push the class on the stack
 	EmitBytes(OP_CLASS, nameConstant);
 	// Mark the class on the stack as a variable
-	DefineVariable(nameConstant, false);
+	DefineVariable(global, false);
 
 	Token className = parser.previous;
 
@@ -844,6 +949,12 @@ void Compiler::ReturnStatement()
 	{
 		Expression();
 		Consume(SEMICOLON, "Expect ';' after return value.");
+		// A call that is the last instruction of the return value reuses the caller's frame.
+		// Jumps that land after it still reach the OP_RETURN below.
+		if (lastCallOffset >= 0 && lastCallOffset == (int32_t)CurrentChunk()->GetSize() - 4)
+		{
+			CurrentChunk()->code[lastCallOffset] = OP_TAIL_CALL;
+		}
 	}
 	// Return always leaves through OP_RETURN with the value on top of the stack.
 	EmitByte(OP_RETURN);
@@ -949,12 +1060,18 @@ VMValue Compiler::EndCompiler()
 		}
 		EmitByte(OP_RETURN);
 	}
+	if (!parser.hadError)
+	{
+		// Measured before fusion, a fused instruction never needs more stack than the sequence it replaces.
+		static_cast<VMFunctionBase*>(function.AsObject())->maxStackSize = ComputeMaxStackSize();
+		PeepholeOptimize();
+	}
 #ifdef DEBUG_PRINT_CODE	
 	// Only print the outermost (script) chunk; nested functions are printed
 	// recursively via DisassembleConstant when the parent chunk is disassembled.
 	if (!parser.hadError && enclosing == nullptr)
 	{
-		std::string disassemblyName = static_cast<std::string>(*function.object);
+		std::string disassemblyName = ObjectToString(function.AsObject());
 		CurrentChunk()->Disassemble(disassemblyName.c_str());
 	}
 #endif // DEBUG_PRINT_CODE
@@ -1049,7 +1166,7 @@ void Compiler::Super(bool)
 void Compiler::String(bool /*canAssign*/)
 {
 	const std::string& lexeme = parser.previous.lexeme;
-	EmitConstant(VM::Create(StringValue::CreateRaw(lexeme)));
+	EmitConstant(VM::CreateString(lexeme));
 }
 
 void Compiler::Grouping(bool /*canAssign*/)
@@ -1214,7 +1331,7 @@ void Compiler::NamedVariable(const Token& name, bool canAssign)
 		}
 		else
 		{
-			arg = IdentifierConstant(name);
+			arg = GlobalSlot(name);
 			isFinal = globalFinals[arg];
 			getOp = arg <= 0xFF ? OP_GET_GLOBAL : OP_GET_GLOBAL_LONG;
 			setOp = arg <= 0xFF ? OP_SET_GLOBAL : OP_SET_GLOBAL_LONG;
@@ -1280,7 +1397,14 @@ uint8_t Compiler::ArgumentList()
 void Compiler::Call(bool)
 {
 	uint8_t argCount = ArgumentList();
+	uint32_t cacheIndex = CurrentChunk()->AppendInlineCache();
+	if (cacheIndex > 0xFFFF)
+	{
+		Error("Too many calls in one function.");
+	}
+	lastCallOffset = (int32_t)CurrentChunk()->GetSize();
 	EmitBytes(OP_CALL, argCount);
+	EmitBytes((uint8_t)((cacheIndex >> 8) & 0xFF), (uint8_t)(cacheIndex & 0xFF));
 }
 
 void Compiler::EmitPropertyAccess(uint8_t op, uint8_t opLong, uint32_t nameConstant, uint32_t cacheIndex)
@@ -1531,12 +1655,14 @@ uint32_t Compiler::ParseVariable(const std::string& errorMessage, bool isFinal)
 	{
 		return UINT8_MAX;
 	}
-	return IdentifierConstant(parser.previous);
+	return GlobalSlot(parser.previous);
 }
 
 uint32_t Compiler::MakeConstant(VMValue value)
 {
 	int32_t constantIndex = CurrentChunk()->AddConstant(value);
+	// The function may already have been promoted while it is being compiled.
+	VM::GetInstance().WriteBarrier(function.AsObject(), value);
 	if (constantIndex > 0xFFFFFF)
 	{
 		Error("Too many constants in one chunk.");
@@ -1545,12 +1671,24 @@ uint32_t Compiler::MakeConstant(VMValue value)
 	return (uint32_t)constantIndex;
 }
 
+uint32_t Compiler::GlobalSlot(const Token& name)
+{
+	// Globals are bound to VM slots at compile time, the VM never looks a name up while running.
+	size_t slot = VM::GetInstance().ReserveGlobalSlot(name.lexeme);
+	if (slot > 0xFFFFFF)
+	{
+		Error("Too many global variables.");
+		return 0;
+	}
+	return (uint32_t)slot;
+}
+
 uint32_t Compiler::IdentifierConstant(const Token& name)
 {
-	return MakeConstant(VM::Create(StringValue::CreateRaw(name.lexeme)));
+	return MakeConstant(VM::CreateString(name.lexeme));
 }
 
-void Compiler::DefineVariable(uint32_t nameConstant, bool isFinal)
+void Compiler::DefineVariable(uint32_t global, bool isFinal)
 {
 	// Define a local variable. Mark it defined at this scope depth and emit no bytecode.
 	if (scopeDepth > 0)
@@ -1561,19 +1699,19 @@ void Compiler::DefineVariable(uint32_t nameConstant, bool isFinal)
 	}
 
 	// Define a global variable. Emit bytecode to define it at the top level.
-	if (nameConstant <= 0xFF)
+	if (global <= 0xFF)
 	{
-		EmitBytes(OP_DEFINE_GLOBAL, (uint8_t)nameConstant);
+		EmitBytes(OP_DEFINE_GLOBAL, (uint8_t)global);
 	}
 	else
 	{
 		EmitBytes(OP_DEFINE_GLOBAL_LONG,
-			(uint8_t)((nameConstant >> 16) & 0xFF),
-			(uint8_t)((nameConstant >> 8) & 0xFF),
-			(uint8_t)(nameConstant & 0xFF));
+			(uint8_t)((global >> 16) & 0xFF),
+			(uint8_t)((global >> 8) & 0xFF),
+			(uint8_t)(global & 0xFF));
 	}
 
-	globalFinals[nameConstant] = isFinal;
+	globalFinals[global] = isFinal;
 }
 
 void Compiler::DeclareVariable(bool isFinal)
@@ -1732,6 +1870,329 @@ void Compiler::PatchBreaks(int32_t loopStart)
 	}
 }
 
+// --- Peephole Optimization ---
+
+void Compiler::PeepholeOptimize()
+{
+	Chunk* chunk = CurrentChunk();
+	int32_t count = chunk->GetSize();
+	const uint8_t* code = chunk->code;
+
+	// An instruction that is jumped to must stay addressable, so it may only start a fused sequence.
+	std::vector<bool> isJumpTarget(count + 1, false);
+	for (int32_t offset = 0; offset < count; offset += chunk->GetInstructionSize(offset))
+	{
+		uint8_t op = code[offset];
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+		{
+			int32_t jump = (code[offset + 1] << 8) | code[offset + 2];
+			isJumpTarget[op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump] = true;
+		}
+	}
+
+	// Check that the instructions starting at offset are exactly ops, and record where each of them starts.
+	auto Match = [&](int32_t offset, std::initializer_list<uint8_t> ops, int32_t* starts) -> bool {
+		int32_t index = 0;
+		for (uint8_t op : ops)
+		{
+			if (offset >= count || code[offset] != op || (index > 0 && isJumpTarget[offset]))
+			{
+				return false;
+			}
+			starts[index++] = offset;
+			offset += chunk->GetInstructionSize(offset);
+		}
+		return true;
+	};
+
+	struct JumpFixup
+	{
+		int32_t operand;
+		int32_t end;
+		int32_t oldTarget;
+		bool backward;
+	};
+
+	std::vector<uint8_t> newCode;
+	std::vector<int32_t> newLines;
+	std::vector<int32_t> newColumns;
+	std::vector<int32_t> newOffsets(count + 1, -1);
+	std::vector<JumpFixup> fixups;
+
+	// Fused bytes take the position of the instruction that can raise a runtime error.
+	auto Emit = [&](uint8_t byte, int32_t sourceOffset) {
+		newCode.push_back(byte);
+		newLines.push_back(chunk->lines[sourceOffset]);
+		newColumns.push_back(chunk->columns[sourceOffset]);
+	};
+
+	// Arithmetic opcodes share their layout with the RRR and RRK three-address groups.
+	const uint8_t arithmeticOps[] = { OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE };
+
+	int32_t starts[5];
+	int32_t offset = 0;
+	while (offset < count)
+	{
+		newOffsets[offset] = (int32_t)newCode.size();
+
+		// local = local + constant; as a statement.
+		if (Match(offset, { OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP }, starts) &&
+			code[starts[0] + 1] == code[starts[3] + 1] &&
+			chunk->constants.values[code[starts[1] + 1]].IsNumber())
+		{
+			Emit(OP_INC_LOCAL, starts[2]);
+			Emit(code[starts[0] + 1], starts[2]);
+			Emit(code[starts[1] + 1], starts[2]);
+			offset = starts[4] + 1;
+			continue;
+		}
+
+		// The three-address forms only replace statements that leave the stack as they found it.
+		bool lowered = false;
+		for (uint8_t op : arithmeticOps)
+		{
+			// dst = a op b; and dst = a op constant;
+			bool isRRR = Match(offset, { OP_GET_LOCAL, OP_GET_LOCAL, op, OP_SET_LOCAL, OP_POP }, starts);
+			if (isRRR || Match(offset, { OP_GET_LOCAL, OP_CONSTANT, op, OP_SET_LOCAL, OP_POP }, starts))
+			{
+				Emit((uint8_t)((isRRR ? OP_ADD_RRR : OP_ADD_RRK) + (op - OP_ADD)), starts[2]);
+				Emit(code[starts[3] + 1], starts[2]);
+				Emit(code[starts[0] + 1], starts[2]);
+				Emit(code[starts[1] + 1], starts[2]);
+				offset = starts[4] + 1;
+				lowered = true;
+				break;
+			}
+		}
+		if (lowered)
+		{
+			continue;
+		}
+
+		// dst = src; and dst = constant;
+		bool isMove = Match(offset, { OP_GET_LOCAL, OP_SET_LOCAL, OP_POP }, starts);
+		if (isMove || Match(offset, { OP_CONSTANT, OP_SET_LOCAL, OP_POP }, starts))
+		{
+			Emit(isMove ? OP_MOVE : OP_LOAD_CONSTANT, starts[0]);
+			Emit(code[starts[1] + 1], starts[0]);
+			Emit(code[starts[0] + 1], starts[0]);
+			offset = starts[2] + 1;
+			continue;
+		}
+
+		// Same contract as OP_LT_LOCAL_CONST_JUMP with two local operands.
+		if (Match(offset, { OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS, OP_JUMP_IF_FALSE, OP_POP }, starts))
+		{
+			Emit(OP_LESS_JUMP_RR, starts[2]);
+			Emit(code[starts[0] + 1], starts[2]);
+			Emit(code[starts[1] + 1], starts[2]);
+			int32_t jump = (code[starts[3] + 1] << 8) | code[starts[3] + 2];
+			fixups.push_back({ (int32_t)newCode.size(), (int32_t)newCode.size() + 2, starts[3] + 3 + jump, false });
+			Emit(0xFF, starts[2]);
+			Emit(0xFF, starts[2]);
+			offset = starts[4] + 1;
+			continue;
+		}
+
+		// object.name = value;
+		if (Match(offset, { OP_GET_LOCAL, OP_GET_LOCAL, OP_SET_PROPERTY, OP_POP }, starts))
+		{
+			Emit(OP_SET_PROPERTY_RR, starts[2]);
+			Emit(code[starts[0] + 1], starts[2]);
+			Emit(code[starts[2] + 1], starts[2]);
+			Emit(code[starts[1] + 1], starts[2]);
+			Emit(code[starts[2] + 2], starts[2]);
+			offset = starts[3] + 1;
+			continue;
+		}
+
+		// local.name, the result is pushed like OP_GET_PROPERTY's so getters can return into it.
+		if (Match(offset, { OP_GET_LOCAL, OP_GET_PROPERTY }, starts))
+		{
+			Emit(OP_GET_LOCAL_PROPERTY, starts[1]);
+			Emit(code[starts[0] + 1], starts[1]);
+			Emit(code[starts[1] + 1], starts[1]);
+			Emit(code[starts[1] + 2], starts[1]);
+			offset = starts[1] + 3;
+			continue;
+		}
+
+		// Loop and branch conditions of the form local < constant.
+		if (Match(offset, { OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP }, starts))
+		{
+			Emit(OP_LT_LOCAL_CONST_JUMP, starts[2]);
+			Emit(code[starts[0] + 1], starts[2]);
+			Emit(code[starts[1] + 1], starts[2]);
+			int32_t jump = (code[starts[3] + 1] << 8) | code[starts[3] + 2];
+			fixups.push_back({ (int32_t)newCode.size(), (int32_t)newCode.size() + 2, starts[3] + 3 + jump, false });
+			Emit(0xFF, starts[2]);
+			Emit(0xFF, starts[2]);
+			offset = starts[4] + 1;
+			continue;
+		}
+
+		if (Match(offset, { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD }, starts))
+		{
+			Emit(OP_ADD_LOCALS, starts[2]);
+			Emit(code[starts[0] + 1], starts[2]);
+			Emit(code[starts[1] + 1], starts[2]);
+			offset = starts[2] + 1;
+			continue;
+		}
+
+		// The compiler spells <= and >= as a negated comparison.
+		if (Match(offset, { OP_GREATER, OP_NOT }, starts) || Match(offset, { OP_LESS, OP_NOT }, starts))
+		{
+			Emit(code[offset] == OP_GREATER ? OP_LESS_EQUAL : OP_GREATER_EQUAL, starts[0]);
+			offset = starts[1] + 1;
+			continue;
+		}
+
+		int32_t size = chunk->GetInstructionSize(offset);
+		uint8_t op = code[offset];
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+		{
+			int32_t jump = (code[offset + 1] << 8) | code[offset + 2];
+			int32_t newStart = (int32_t)newCode.size();
+			fixups.push_back({ newStart + 1, newStart + 3, op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump, op == OP_LOOP });
+		}
+		for (int32_t i = 0; i < size; ++i)
+		{
+			Emit(code[offset + i], offset + i);
+		}
+		offset += size;
+	}
+	newOffsets[count] = (int32_t)newCode.size();
+
+	// Fusing only shrinks code, so every relocated jump still fits in its 16-bit operand.
+	for (const JumpFixup& fixup : fixups)
+	{
+		int32_t newTarget = newOffsets[fixup.oldTarget];
+		assert(newTarget != -1);
+		int32_t jump = fixup.backward ? fixup.end - newTarget : newTarget - fixup.end;
+		newCode[fixup.operand] = (uint8_t)((jump >> 8) & 0xFF);
+		newCode[fixup.operand + 1] = (uint8_t)(jump & 0xFF);
+	}
+
+	for (size_t i = 0; i < newCode.size(); ++i)
+	{
+		chunk->code[i] = newCode[i];
+		chunk->lines[i] = newLines[i];
+		chunk->columns[i] = newColumns[i];
+	}
+	chunk->count = (int32_t)newCode.size();
+}
+
+// --- Stack Depth Analysis ---
+
+int32_t Compiler::ComputeMaxStackSize()
+{
+	Chunk* chunk = CurrentChunk();
+	int32_t count = chunk->GetSize();
+	const uint8_t* code = chunk->code;
+
+	// Net stack effect of the instruction at offset. Calls leave a single result in place of the callee and arguments.
+	auto StackEffect = [&](int32_t offset) -> int32_t {
+		switch (code[offset])
+		{
+			case OP_CONSTANT:
+			case OP_CONSTANT_LONG:
+			case OP_NIL:
+			case OP_TRUE:
+			case OP_FALSE:
+			case OP_GET_GLOBAL:
+			case OP_GET_GLOBAL_LONG:
+			case OP_GET_LOCAL:
+			case OP_GET_LOCAL_LONG:
+			case OP_GET_UPVALUE:
+			case OP_DUP:
+			case OP_CLASS:
+				return 1;
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_EQUAL:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_PRINT:
+			case OP_POP:
+			case OP_DEFINE_GLOBAL:
+			case OP_DEFINE_GLOBAL_LONG:
+			case OP_CLOSE_UPVALUE:
+			case OP_SET_PROPERTY:
+			case OP_SET_PROPERTY_LONG:
+			case OP_GET_INDEX:
+			case OP_METHOD:
+			case OP_METHOD_LONG:
+			case OP_CLASS_METHOD:
+			case OP_CLASS_METHOD_LONG:
+			case OP_INHERIT:
+			case OP_GET_SUPER:
+			case OP_GET_SUPER_LONG:
+				return -1;
+			case OP_SET_INDEX:
+				return -2;
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			case OP_INNER_INVOKE:
+				return -code[offset + 1];
+			case OP_INVOKE:
+			case OP_ROOT_INVOKE:
+				return -code[offset + 2];
+			case OP_INVOKE_LONG:
+			case OP_ROOT_INVOKE_LONG:
+				return -code[offset + 4];
+			case OP_SUPER_INVOKE:
+				// The superclass is popped as well.
+				return -code[offset + 2] - 1;
+			case OP_SUPER_INVOKE_LONG:
+				return -code[offset + 4] - 1;
+			default:
+				return 0;
+		}
+	};
+
+	// Walk every reachable path; slot 0 and the parameters are on the stack on entry.
+	int32_t entryDepth = 1 + static_cast<VMFunctionBase*>(function.AsObject())->Arity();
+	int32_t maxDepth = entryDepth;
+	std::vector<int32_t> depthAt(count, -1);
+	std::vector<int32_t> worklist;
+	auto Visit = [&](int32_t offset, int32_t depth) {
+		if (offset < count && depth > depthAt[offset])
+		{
+			depthAt[offset] = depth;
+			worklist.push_back(offset);
+		}
+	};
+	Visit(0, entryDepth);
+	while (!worklist.empty())
+	{
+		int32_t offset = worklist.back();
+		worklist.pop_back();
+		int32_t depth = depthAt[offset] + StackEffect(offset);
+		maxDepth = std::max(maxDepth, std::max(depth, depthAt[offset]));
+
+		uint8_t op = code[offset];
+		int32_t next = offset + chunk->GetInstructionSize(offset);
+		if (op == OP_RETURN)
+		{
+			continue;
+		}
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+		{
+			int32_t jump = (code[offset + 1] << 8) | code[offset + 2];
+			Visit(op == OP_LOOP ? next - jump : next + jump, depth);
+			if (op != OP_JUMP_IF_FALSE)
+			{
+				continue;
+			}
+		}
+		Visit(next, depth);
+	}
+	return maxDepth;
+}
+
 // --- Error Handling ---
 
 void Compiler::Error(const char* message)
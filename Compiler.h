@@ -1,6 +1,9 @@
 #pragma once
 #include "Scanner.h"
 #include "Chunk.h"
+#include "NameTable.h"
+#include "Shape.h"
+#include <memory>
 #include <vector>
 
 class Compiler
@@ -34,25 +37,40 @@ public:
 	};
 	
 	friend class VM;
-	struct VMFunctionBase : public Value
+	struct VMFunctionBase : public VMObject
 	{
-		virtual int Arity() const = 0;
-		virtual VMFunctionType GetType() const = 0;
-		virtual bool IsGetter() const { return false; }
-		void Blacken(VM& vm) override;
+		VMFunctionType functionType;
+		// Operand stack slots a frame of this function can occupy, including the callee slot and arguments.
+		// Computed by the compiler so VM::Call can reserve the whole frame up front.
+		int32_t maxStackSize = 0;
+
+		VMFunctionBase(ValueType inType, VMFunctionType inFunctionType)
+			: functionType(inFunctionType)
+		{
+			this->type = inType;
+		}
+		VMFunctionType GetType() const { return functionType; }
+		// Dispatch on functionType, defined after the concrete function types.
+		inline int Arity() const;
+		inline bool IsGetter() const;
+		inline Chunk* GetChunk() const;
+		void Blacken(VM& vm);
+		size_t Size() const;
+		std::string ToString() const;
+		// Deletes through the concrete type so the arena gets the real size.
+		void Destroy();
 	};
 
 	// Lightweight placeholder for the top-level script callable.
-	// Inherits directly from Value so no extra headers are needed.
 	struct ScriptFunction : public VMFunctionBase
 	{
 		Chunk* chunk = nullptr;
 		explicit ScriptFunction(Chunk* inChunk = nullptr)
-			: chunk(inChunk)
+			: VMFunctionBase(TYPE_CALLABLE, VM_FUNC_SCRIPT)
+			, chunk(inChunk)
 		{
-			this->type = TYPE_CALLABLE;
 		}
-		~ScriptFunction() override
+		~ScriptFunction()
 		{
 			if (chunk)
 			{
@@ -60,11 +78,8 @@ public:
 				delete chunk;
 			}
 		}
-		int Arity() const override { return 0; }
-		Chunk* GetChunk() const override { return chunk; }
-		operator std::string() const override { return "<script>"; }
-		VMFunctionType GetType() const override { return VM_FUNC_SCRIPT; }
-		size_t Size() const override { return sizeof(*this); }
+		std::string ToString() const { return "<script>"; }
+		size_t Size() const { return sizeof(*this); }
 	};
 
 	// Placeholder for a named function compiled by the VM compiler.
@@ -76,12 +91,12 @@ public:
 		bool isGetter = false;
 		Chunk* chunk = nullptr;
 		explicit VMFunctionValue(const std::string& inName, Chunk* inChunk = nullptr)
-			: name(inName)
+			: VMFunctionBase(TYPE_CALLABLE, VM_FUNC_FUNCTION)
+			, name(inName)
 			, chunk(inChunk)
 		{
-			this->type = TYPE_CALLABLE;
 		}
-		~VMFunctionValue() override
+		~VMFunctionValue()
 		{
 			if (chunk)
 			{
@@ -89,12 +104,8 @@ public:
 				delete chunk;
 			}
 		}
-		int Arity() const override { return arity; }
-		Chunk* GetChunk() const override { return chunk; }
-		operator std::string() const override { return "<fn " + name + ">"; }
-		VMFunctionType GetType() const override { return VM_FUNC_FUNCTION; }
-		bool IsGetter() const override { return isGetter; }
-		size_t Size() const override { return sizeof(*this) + name.capacity(); }
+		std::string ToString() const { return "<fn " + name + ">"; }
+		size_t Size() const { return sizeof(*this) + name.capacity(); }
 	};
 
 	typedef VMValue(*NativeFn)(int argCount, VMValue* args);
@@ -106,14 +117,11 @@ public:
 		int32_t arity = 0;
 		NativeFn function;
 		explicit NativeFunctionValue(const std::string& inName, NativeFn inFunction, int32_t inArity)
-			: name(inName), function(inFunction), arity(inArity)
+			: VMFunctionBase(TYPE_CALLABLE, VM_FUNC_NATIVE), name(inName), arity(inArity), function(inFunction)
 		{
-			this->type = TYPE_CALLABLE;
 		}
-		int Arity() const override { return arity; }
-		operator std::string() const override { return "<native fn " + name + ">"; }
-		VMFunctionType GetType() const override { return VM_FUNC_NATIVE; }
-		size_t Size() const override { return sizeof(*this) + name.capacity(); }
+		std::string ToString() const { return "<native fn " + name + ">"; }
+		size_t Size() const { return sizeof(*this) + name.capacity(); }
 	};
 
 	// Placeholder for a closure value, which wraps a function and its upvalues.
@@ -122,84 +130,131 @@ public:
 	{
 		VMValue function;
 		std::vector<VMValue> upvalues;
+		// Some OP_CALL site cached this closure, freeing it has to retire the call caches.
+		bool isCallCached = false;
 		explicit VMClosureValue(VMValue inFunction, std::vector<VMValue> inUpvalues)
-			: function(inFunction)
+			: VMFunctionBase(TYPE_CALLABLE, VM_FUNC_CLOSURE)
+			, function(inFunction)
 			, upvalues(std::move(inUpvalues))
 		{
-			this->type = TYPE_CALLABLE;
-		}
-		int Arity() const override
-		{
-			VMFunctionBase* functionValue = static_cast<VMFunctionBase*>(function.object);
-			return functionValue->Arity();
 		}
-		Chunk* GetChunk() const override
+		void Blacken(VM& vm);
+		std::string ToString() const
 		{
-			return function.GetChunk();
+			return "<closure " + static_cast<VMFunctionBase*>(function.AsObject())->ToString() + ">";
 		}
-		void Blacken(VM& vm) override;
-		bool IsGetter() const override
-		{
-			return function.object != nullptr && static_cast<VMFunctionBase*>(function.object)->IsGetter();
-		}
-		operator std::string() const override
-		{
-			VMFunctionBase* functionValue = static_cast<VMFunctionBase*>(function.object);
-			return "<closure " + functionValue->operator std::string() + ">";
-		}
-		VMFunctionType GetType() const override { return VM_FUNC_CLOSURE; }
-		size_t Size() const override { return sizeof(*this) + upvalues.capacity() * sizeof(VMValue); }
+		size_t Size() const { return sizeof(*this) + upvalues.capacity() * sizeof(VMValue); }
 	};
 
-	struct VMClassValue : public Value
+	struct VMClassValue : public VMObject
 	{
-		static constexpr uint32_t INVALID_SLOT = UINT32_MAX;
+		struct Method
+		{
+			VMValue method;
+			// Copied down from a superclass, as opposed to defined in this class's body.
+			bool inherited = false;
+		};
 		std::string name;
-		std::unordered_map<std::string, uint32_t> fieldToSlot;
-		std::unordered_map<std::string, VMValue> methods;
-		std::unordered_map<std::string, VMValue> classMethods;
-		uint32_t slotNum;
+		// Caps the inline slots of an instance, keeping instances in the arena's small size classes.
+		static constexpr uint32_t MAX_INLINE_FIELDS = 32;
+		// Every shape the class's instances have taken, shapes[0] is the empty root.
+		// Owned by the class, which outlives each instance that points at one.
+		std::vector<std::unique_ptr<Shape>> shapes;
+		// Own methods plus every inherited one, so a lookup never walks the superclass chain.
+		NameTable<Method> methods;
+		NameTable<VMValue> classMethods;
+		// The class's own init closure, set by OP_METHOD so construction skips the method lookup.
+		VMValue initializer;
+		// Inline slots given to new instances, the most fields any instance has had so far.
+		uint32_t inlineFieldCount;
 		VMValue superClass;
+		// Unique for the life of the process, inline caches key on it instead of the class address.
+		uint64_t classId;
+		// Starts at 1, an empty cache entry holds 0.
+		static uint64_t nextClassId;
 		explicit VMClassValue(const std::string& inName)
 			: name(inName)
-			, slotNum(0)
+			, initializer()
+			, inlineFieldCount(0)
 			, superClass()
+			, classId(nextClassId++)
 		{
 			this->type = TYPE_CLASS;
+			shapes.push_back(std::make_unique<Shape>(nextClassId++, nullptr, nullptr));
 		}
-		virtual operator std::string() const override { return "<class " + name + ">"; }
-		virtual size_t Size() const override  { return sizeof(*this) + name.capacity(); }
-		uint32_t GetSlot(const std::string& fieldName) const;
-		uint32_t GetOrCreateSlot(const std::string& fieldName);
-		VMValue FindDirectMethod(const std::string& methodName) const;
-		VMValue FindMethod(const std::string& methodName) const;
-		VMValue FindClassMethod(const std::string& methodName) const;
-		void Blacken(VM& vm) override;
+		std::string ToString() const { return "<class " + name + ">"; }
+		size_t Size() const { return sizeof(*this) + name.capacity() + shapes.size() * sizeof(Shape); }
+		Shape* RootShape() const { return shapes[0].get(); }
+		// The shape an instance of shape from moves to when it gains fieldName, made on first use.
+		// Names are interned VM strings. Returns nullptr when a new shape would pass the heap cap.
+		Shape* Transition(Shape* from, VMStringValue* fieldName);
+
+		// A method defined in this class's own body.
+		VMValue FindDirectMethod(const VMStringValue* methodName) const;
+		VMValue FindMethod(const VMStringValue* methodName) const;
+		VMValue FindClassMethod(const VMStringValue* methodName) const;
+		void SetMethod(VMStringValue* methodName, VMValue method);
+		void SetClassMethod(VMStringValue* methodName, VMValue method);
+		// Copy the superclass's methods down, must run before this class defines its own.
+		void Inherit(VMClassValue* superClassValue);
+		void Blacken(VM& vm);
 	};
 
-	struct VMInstanceValue : public Value
+	// Fields live in inline slots allocated right behind the object, as many as the class's instances have
+	// needed so far. Fields added past those spill into an out-of-line overflow array.
+	struct VMInstanceValue : public VMObject
 	{
 		VMValue classValue;
-		std::vector<VMValue> fields;
-		explicit VMInstanceValue(VMValue inClass)
-			: classValue(inClass)
+		Shape* shape;
+		VMValue* overflow;
+		uint32_t inlineCapacity;
+		uint32_t overflowCapacity;
+
+		// Instances vary in size, they are made here and freed by Destroy.
+		static VMInstanceValue* New(VMValue inClass);
+		void Destroy();
+
+		std::string ToString() const
 		{
-			this->type = TYPE_INSTANCE;
+			VMClassValue* classObj = static_cast<VMClassValue*>(classValue.AsObject());
+			return "<instance of " + classObj->name + ">";
 		}
-		virtual operator std::string() const override
+		size_t Size() const { return AllocationSize(inlineCapacity) + overflowCapacity * sizeof(VMValue); }
+		// The slot must belong to the instance's shape.
+		void SetField(uint32_t slotIndex, VMValue value)
 		{
-			VMClassValue* classObj = static_cast<VMClassValue*>(classValue.object);
-			return "<instance of " + classObj->name + ">";
+			if (slotIndex < inlineCapacity)
+			{
+				InlineFields()[slotIndex] = value;
+			}
+			else
+			{
+				overflow[slotIndex - inlineCapacity] = value;
+			}
 		}
-		virtual size_t Size() const override
+		VMValue GetField(uint32_t slotIndex) const
+		{
+			return slotIndex < inlineCapacity ? InlineFields()[slotIndex] : overflow[slotIndex - inlineCapacity];
+		}
+		// Append the field that moves the instance to the child shape next.
+		// Returns false, leaving the instance unchanged, when its overflow array cannot grow under the heap cap.
+		bool AddField(Shape* next, VMValue value);
+		void Blacken(VM& vm);
+	protected:
+		VMInstanceValue(VMValue inClass, uint32_t inInlineCapacity)
+			: classValue(inClass)
+			, shape(static_cast<VMClassValue*>(inClass.AsObject())->RootShape())
+			, overflow(nullptr)
+			, inlineCapacity(inInlineCapacity)
+			, overflowCapacity(0)
 		{
-			size_t size = sizeof(*this);
-			size += fields.size() * sizeof(VMValue);
-			return size;
+			this->type = TYPE_INSTANCE;
 		}
-		void SetField(uint32_t slotIndex, VMValue value);
-		VMValue GetField(uint32_t slotIndex);
-		void Blacken(VM& vm) override;
+		~VMInstanceValue();
+
+		static size_t AllocationSize(uint32_t inlineCapacity) { return sizeof(VMInstanceValue) + inlineCapacity * sizeof(VMValue); }
+		VMValue* InlineFields() { return reinterpret_cast<VMValue*>(this + 1); }
+		const VMValue* InlineFields() const { return reinterpret_cast<const VMValue*>(this + 1); }
 	};
 
 	struct BoundMethodValue : public VMFunctionBase
@@ -208,32 +263,22 @@ public:
 		VMValue receiver;
 		VMValue method;
 		explicit BoundMethodValue(VMValue inReceiver, VMValue inMethod)
-			: receiver(inReceiver)
+			: VMFunctionBase(TYPE_BOUND_METHOD, VM_FUNC_METHOD)
+			, receiver(inReceiver)
 			, method(inMethod)
 		{
-			this->type = TYPE_BOUND_METHOD;
 		}
-		virtual operator std::string() const override
+		std::string ToString() const
 		{
-			VMClosureValue* closure = static_cast<VMClosureValue*>(method.object);
-			VMInstanceValue* instance = static_cast<VMInstanceValue*>(receiver.object);
-			return "<bound method " + closure->function.object->operator std::string() + " of " + instance->operator std::string() + ">";
+			VMClosureValue* closure = static_cast<VMClosureValue*>(method.AsObject());
+			VMInstanceValue* instance = static_cast<VMInstanceValue*>(receiver.AsObject());
+			return "<bound method " + ObjectToString(closure->function.AsObject()) + " of " + instance->ToString() + ">";
 		}
-		virtual size_t Size() const override
+		size_t Size() const
 		{
 			return sizeof(*this);
 		}
-		virtual int Arity() const override
-		{
-			VMClosureValue* closure = static_cast<VMClosureValue*>(method.object);
-			return closure->Arity();
-		}
-		void Blacken(VM& vm) override;
-		virtual VMFunctionType GetType() const override { return VM_FUNC_METHOD; }
-		bool IsGetter() const override
-		{
-			return method.object != nullptr && static_cast<VMFunctionBase*>(method.object)->IsGetter();
-		}
+		void Blacken(VM& vm);
 	};
 private:
 	enum Precedence
@@ -333,6 +378,8 @@ private:
 
 	uint32_t currentLoopStart = -1;
 	uint32_t currentLoopContinue = -1;
+	// Offset of the most recent OP_CALL, lets ReturnStatement spot a call in tail position.
+	int32_t lastCallOffset = -1;
 	std::unordered_map<uint32_t, std::vector<uint32_t>> breakJumpPatches;
 
 	void Init(FunctionType type, const std::string& name = "");
@@ -415,7 +462,8 @@ private:
 	uint32_t ParseVariable(const std::string& errorMessage, bool isFinal);
 	uint32_t MakeConstant(VMValue value);
 	uint32_t IdentifierConstant(const Token& name);
-	void DefineVariable(uint32_t nameConstant, bool isFinal);
+	uint32_t GlobalSlot(const Token& name);
+	void DefineVariable(uint32_t global, bool isFinal);
 	void DeclareVariable(bool isFinal);
 	void NamedVariable(const Token& name, bool canAssign);
 	void AddLocal(const Token& name, bool isFinal);
@@ -430,6 +478,10 @@ private:
 	void EmitLoop(int32_t loopStart);
 	void PatchBreaks(int32_t loopStart);
 
+	// --- Peephole Optimization ---
+	void PeepholeOptimize();
+	int32_t ComputeMaxStackSize();
+
 	// --- Error Handling ---
 	void Error(const char* message);
 	void ErrorAt(Token* token, const char* message);
@@ -438,3 +490,59 @@ private:
 	// --- Argument List Parsing ---
 	uint8_t ArgumentList();
 };
+
+inline int Compiler::VMFunctionBase::Arity() const
+{
+	switch (functionType)
+	{
+		case VM_FUNC_FUNCTION:
+			return static_cast<const VMFunctionValue*>(this)->arity;
+		case VM_FUNC_NATIVE:
+			return static_cast<const NativeFunctionValue*>(this)->arity;
+		case VM_FUNC_CLOSURE:
+			return static_cast<VMFunctionBase*>(static_cast<const VMClosureValue*>(this)->function.AsObject())->Arity();
+		case VM_FUNC_METHOD:
+			return static_cast<VMFunctionBase*>(static_cast<const BoundMethodValue*>(this)->method.AsObject())->Arity();
+		default:
+			return 0;
+	}
+}
+
+inline bool Compiler::VMFunctionBase::IsGetter() const
+{
+	switch (functionType)
+	{
+		case VM_FUNC_FUNCTION:
+			return static_cast<const VMFunctionValue*>(this)->isGetter;
+		case VM_FUNC_CLOSURE:
+		{
+			VMObject* function = static_cast<const VMClosureValue*>(this)->function.AsObject();
+			return function != nullptr && static_cast<VMFunctionBase*>(function)->IsGetter();
+		}
+		case VM_FUNC_METHOD:
+		{
+			VMObject* method = static_cast<const BoundMethodValue*>(this)->method.AsObject();
+			return method != nullptr && static_cast<VMFunctionBase*>(method)->IsGetter();
+		}
+		default:
+			return false;
+	}
+}
+
+inline Chunk* Compiler::VMFunctionBase::GetChunk() const
+{
+	switch (functionType)
+	{
+		case VM_FUNC_SCRIPT:
+			return static_cast<const ScriptFunction*>(this)->chunk;
+		case VM_FUNC_FUNCTION:
+			return static_cast<const VMFunctionValue*>(this)->chunk;
+		case VM_FUNC_CLOSURE:
+		{
+			VMObject* function = static_cast<const VMClosureValue*>(this)->function.AsObject();
+			return function != nullptr ? static_cast<VMFunctionBase*>(function)->GetChunk() : nullptr;
+		}
+		default:
+			return nullptr;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include "Value.h"
+#include <vector>
+
+// Flat map from interned names to values, open addressing with linear probing on the hash each name keeps.
+// Names are interned, so a key matches by pointer and a lookup never compares characters.
+// Entries are never removed, classes only ever gain fields and methods.
+template <typename T>
+class NameTable
+{
+public:
+	struct Entry
+	{
+		VMStringValue* key = nullptr;
+		T value{};
+	};
+
+	// Return the value stored under name, or nullptr if there is none.
+	const T* Find(const VMStringValue* name) const
+	{
+		if (count == 0)
+		{
+			return nullptr;
+		}
+		size_t mask = entries.size() - 1;
+		for (size_t index = name->hash & mask; ; index = (index + 1) & mask)
+		{
+			const Entry& entry = entries[index];
+			if (entry.key == name)
+			{
+				return &entry.value;
+			}
+			if (entry.key == nullptr)
+			{
+				return nullptr;
+			}
+		}
+	}
+
+	// Insert or overwrite the value stored under name.
+	void Set(VMStringValue* name, const T& value)
+	{
+		if ((count + 1) * MAX_LOAD_DENOMINATOR > entries.size() * MAX_LOAD_NUMERATOR)
+		{
+			Grow();
+		}
+		Entry& entry = Slot(name);
+		if (entry.key == nullptr)
+		{
+			entry.key = name;
+			++count;
+		}
+		entry.value = value;
+	}
+
+	size_t Count() const { return count; }
+
+	template <typename Function>
+	void ForEach(Function function) const
+	{
+		for (const Entry& entry : entries)
+		{
+			if (entry.key != nullptr)
+			{
+				function(entry.key, entry.value);
+			}
+		}
+	}
+protected:
+	static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+	static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+	// Most classes have a handful of fields and methods.
+	static constexpr size_t MIN_CAPACITY = 8;
+
+	// The entry holding name, or the empty one where it belongs.
+	Entry& Slot(const VMStringValue* name)
+	{
+		size_t mask = entries.size() - 1;
+		size_t index = name->hash & mask;
+		while (entries[index].key != nullptr && entries[index].key != name)
+		{
+			index = (index + 1) & mask;
+		}
+		return entries[index];
+	}
+
+	void Grow()
+	{
+		std::vector<Entry> oldEntries;
+		oldEntries.swap(entries);
+		entries.resize(oldEntries.empty() ? MIN_CAPACITY : oldEntries.size() * 2);
+		for (Entry& entry : oldEntries)
+		{
+			if (entry.key != nullptr)
+			{
+				Slot(entry.key) = entry;
+			}
+		}
+	}
+
+	// Capacity is a power of two, an empty slot has no key.
+	std::vector<Entry> entries;
+	size_t count = 0;
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include "NameTable.h"
+#include <cstdint>
+
+// Layout of an instance: which field lives in which slot. Shapes never change, an instance that gains
+// a field moves to the child shape for that name, so instances that gained the same fields in the same
+// order share one shape. The tree of shapes is owned by the class, rooted at the shape with no fields.
+struct Shape
+{
+	static constexpr uint32_t INVALID_SLOT = UINT32_MAX;
+
+	// Unique for the life of the process, inline caches key on it.
+	uint64_t id;
+	const Shape* parent;
+	// Field added by the transition into this shape, nullptr for the root.
+	VMStringValue* name;
+	uint32_t fieldCount;
+	// Children by the name of the field they add.
+	NameTable<Shape*> transitions;
+
+	Shape(uint64_t inId, const Shape* inParent, VMStringValue* inName)
+		: id(inId)
+		, parent(inParent)
+		, name(inName)
+		, fieldCount(inParent ? inParent->fieldCount + 1 : 0)
+	{
+	}
+
+	// Slot of a field, or INVALID_SLOT. Walks towards the root, only cache misses get here.
+	uint32_t Find(const VMStringValue* fieldName) const
+	{
+		for (const Shape* shape = this; shape->parent != nullptr; shape = shape->parent)
+		{
+			if (shape->name == fieldName)
+			{
+				return shape->fieldCount - 1;
+			}
+		}
+		return INVALID_SLOT;
+	}
+};
@@ -0,0 +1,94 @@
+#include "StringTable.h"
+#include <cstring>
+
+VMStringValue* StringTable::Find(const char* chars, size_t length, uint32_t hash) const
+{
+	if (count == 0)
+	{
+		return nullptr;
+	}
+	size_t mask = entries.size() - 1;
+	for (size_t index = hash & mask; ; index = (index + 1) & mask)
+	{
+		VMStringValue* entry = entries[index];
+		if (entry == nullptr)
+		{
+			return nullptr;
+		}
+		if (entry->hash == hash && entry->value.size() == length && memcmp(entry->value.data(), chars, length) == 0)
+		{
+			return entry;
+		}
+	}
+}
+
+void StringTable::Add(VMStringValue* string)
+{
+	if ((count + 1) * MAX_LOAD_DENOMINATOR > entries.size() * MAX_LOAD_NUMERATOR)
+	{
+		Grow();
+	}
+	size_t mask = entries.size() - 1;
+	size_t index = string->hash & mask;
+	while (entries[index] != nullptr)
+	{
+		index = (index + 1) & mask;
+	}
+	entries[index] = string;
+	++count;
+}
+
+void StringTable::Remove(VMStringValue* string)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	size_t mask = entries.size() - 1;
+	size_t index = string->hash & mask;
+	while (entries[index] != string)
+	{
+		if (entries[index] == nullptr)
+		{
+			return;
+		}
+		index = (index + 1) & mask;
+	}
+
+	// Shift later entries of the probe run back instead of leaving a tombstone,
+	// an entry moves into the hole unless its home slot lies cyclically between the hole and itself.
+	size_t hole = index;
+	for (size_t next = (hole + 1) & mask; entries[next] != nullptr; next = (next + 1) & mask)
+	{
+		size_t home = entries[next]->hash & mask;
+		bool homeAfterHole = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+		if (!homeAfterHole)
+		{
+			entries[hole] = entries[next];
+			hole = next;
+		}
+	}
+	entries[hole] = nullptr;
+	--count;
+}
+
+void StringTable::Clear()
+{
+	entries.clear();
+	count = 0;
+}
+
+void StringTable::Grow()
+{
+	std::vector<VMStringValue*> oldEntries;
+	oldEntries.swap(entries);
+	entries.assign(oldEntries.empty() ? MIN_CAPACITY : oldEntries.size() * 2, nullptr);
+	count = 0;
+	for (VMStringValue* entry : oldEntries)
+	{
+		if (entry != nullptr)
+		{
+			Add(entry);
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "Value.h"
+#include <vector>
+
+// Set of the VM's interned strings, open addressing with linear probing on the hash each string keeps.
+// Entries are weak: the table does not keep a string alive, the VM removes a string when it frees it.
+class StringTable
+{
+public:
+	// Return the interned string with these contents, or nullptr if there is none.
+	VMStringValue* Find(const char* chars, size_t length, uint32_t hash) const;
+	void Add(VMStringValue* string);
+	void Remove(VMStringValue* string);
+	void Clear();
+
+	size_t Count() const { return count; }
+protected:
+	// Grow past this many entries per slot, linear probing degrades quickly above it.
+	static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+	static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+	static constexpr size_t MIN_CAPACITY = 64;
+
+	void Grow();
+
+	// Capacity is a power of two, an empty slot holds nullptr.
+	std::vector<VMStringValue*> entries;
+	size_t count = 0;
+};
@@ -6,6 +6,7 @@
 #include "VM.h"
 #include "Lox.h"
 #include <cstdio>
+#include <cmath>
 #include <vector>
 #include <string>
 #include <utility> // for std::pair
@@ -627,6 +628,10 @@ void TestUnit::RunVMTest()
 		std::string source;
 		std::string expectedOutput;
 		InterpretResult expectedResult = INTERPRET_OK;
+		// Heap cap for this case, 0 keeps the default.
+		size_t maxHeap = 0;
+		// Call depth limit for this case, 0 keeps the default.
+		uint32_t maxFrames = 0;
 	};
 
 	auto MakeLongPropertyAccessSource = []()
@@ -651,6 +656,48 @@ void TestUnit::RunVMTest()
 		return source;
 	};
 
+	// More fields than an instance keeps inline, so the rest go to the overflow array.
+	auto MakeManyFieldsSource = []()
+	{
+		std::string source = "class Wide { } var w = nil; for (var r = 0; r < 3; r = r + 1) { w = Wide(); ";
+		std::string sum = "0";
+		for (int i = 1; i <= 50; ++i)
+		{
+			source += "w.f" + std::to_string(i) + " = " + std::to_string(i) + "; ";
+			sum += " + w.f" + std::to_string(i);
+		}
+		source += "} print " + sum + ";";
+		return source;
+	};
+
+	// The field names are constants, so past the first allocations only shapes and the overflow array grow.
+	auto MakeFieldGrowthSource = []()
+	{
+		std::string source = "class W { } var w = W(); ";
+		for (int i = 0; i < 500; ++i)
+		{
+			source += "w.p" + std::to_string(i) + " = " + std::to_string(i) + "; ";
+		}
+		source += "print \"done\";";
+		return source;
+	};
+
+	auto MakeManyMethodsSource = []()
+	{
+		std::string source = "class Base { ";
+		for (int i = 0; i < 40; ++i)
+		{
+			source += "fun m" + std::to_string(i) + "() { return " + std::to_string(i) + "; } ";
+		}
+		source += "} class Middle < Base { fun m3() { return 100; } } class Leaf < Middle { } var o = Leaf(); var s = 0; ";
+		for (int i = 0; i < 40; ++i)
+		{
+			source += "s = s + o.m" + std::to_string(i) + "(); ";
+		}
+		source += "print s;";
+		return source;
+	};
+
 	const std::vector<TestCase> testCases = {
 		// 基础常量与打印
 		{ "print 1;", "1\n" },
@@ -871,6 +918,123 @@ void TestUnit::RunVMTest()
 		{ "var n = 1; n[\"x\"] = 2;", "Only instances have properties.", INTERPRET_RUNTIME_ERROR },
 		{ "class Box { } var b = Box(); print b[\"missing\"];", "Undefined property 'missing'.", INTERPRET_RUNTIME_ERROR },
 		{ "class Box { } var b = Box(); b[\"x\"] = 1; print b[\"missing\"];", "Undefined property 'missing'.", INTERPRET_RUNTIME_ERROR },
+		// ===== quickened arithmetic =====
+		{ "fun add(a, b) { return a + b; } print add(1, 2); print add(1.5, 2.5); print add(\"a\", \"b\"); print add(3, 4);", "3\n4.000000\nab\n7\n" },
+		{ "fun less(a, b) { return a < b; } print less(1, 2); print less(2.5, 1.5); print less(1, 2.5); print less(3, 2);", "true\nfalse\ntrue\nfalse\n" },
+		{ "fun mul(a, b) { return a * b; } var i = 0; while (i < 3) { print mul(i, 2); i = i + 1; } print mul(1.5, 2.0);", "0\n2\n4\n3.000000\n" },
+		{ "fun sub(a, b) { return a - b; } print sub(5, 3); print sub(\"a\", 1);", "Operands must be numbers!", INTERPRET_RUNTIME_ERROR },
+
+		// ===== peephole superinstructions =====
+		{ "fun sum(n) { var total = 0; for (var i = 0; i < 5; i = i + 1) { total = total + i; } return total; } print sum(5);", "10\n" },
+		{ "fun count() { var i = 0; while (i < 2.5) { print i; i = i + 0.5; } } count();", "0\n0.500000\n1.000000\n1.500000\n2.000000\n" },
+		{ "fun join(a, b) { return a + b; } print join(\"lo\", \"x\"); print join(1.5, 2);", "lox\n3.500000\n" },
+		{ "fun cmp(a, b) { print a <= b; print a >= b; } cmp(1, 2); cmp(2, 2); cmp(2.5, 1);", "true\nfalse\ntrue\ntrue\nfalse\ntrue\n" },
+		{ "fun f() { var i = 0; for (;;) { if (i < 3) { i = i + 1; continue; } break; } print i; } f();", "3\n" },
+		{ "fun f(a) { return a < 1 and a; } print f(0); print f(5);", "0\nfalse\n" },
+		{ "fun f() { var s = \"a\"; s = s + 1; } f();", "Operands must be two numbers or two strings for '+'.", INTERPRET_RUNTIME_ERROR },
+		{ "fun f(a) { if (a < 1) print a; } f(\"x\");", "Operands must be numbers!", INTERPRET_RUNTIME_ERROR },
+
+		// ===== three-address superinstructions =====
+		{ "fun f() { var a = 1; var b = 2; var c = 0; c = a + b; c = c * b; c = c - 1; c = c / 2; print c; } f();", "2\n" },
+		{ "fun f() { var x = 0; x = 2.5; var y = 0; y = x; print y; y = \"s\"; print y; } f();", "2.500000\ns\n" },
+		{ "fun f(n) { var i = 0; var s = 0; while (i < n) { s = s + i; i = i + 1; } print s; } f(4); f(2.5);", "6\n3\n" },
+		{ "class P { } fun f() { var p = P(); var v = 3; p.x = v; var r = 0; for (var i = 0; i < 3; i = i + 1) { r = p.x; } print r; } f();", "3\n" },
+		{ "class P { fun g { return 7; } } fun f() { var p = P(); var r = 0; for (var i = 0; i < 2; i = i + 1) { r = p.g; } print r; } f();", "7\n" },
+		{ "class P { fun init(x) { this.x = x; } fun g { return this.x * 2; } } fun f(p) { return p.x + p.g * 10; } var q = P(2); q.y = 0; print f(P(1)); print f(q); print f(P(3));", "21\n42\n63\n" },
+		{ "class P { } fun f(p) { return 1 + p.missing; } f(P());", "Undefined property 'missing'.", INTERPRET_RUNTIME_ERROR },
+		{ "fun f() { var a = \"s\"; var b = 0; b = a - 1; } f();", "Operands must be numbers!", INTERPRET_RUNTIME_ERROR },
+		{ "fun f() { var a = 1; var b = 0; b = a / 0; } f();", "Division by zero.", INTERPRET_RUNTIME_ERROR },
+		{ "fun f() { var n = 1; var o = 0; o.x = n; } f();", "Only instances have properties.", INTERPRET_RUNTIME_ERROR },
+
+		// ===== stack depth reservation =====
+		{ "fun f(a, b, c, d, e, g, h, i) { return a + b + c + d + e + g + h + i; } print f(1, 2, 3, 4, 5, 6, 7, f(1, 1, 1, 1, 1, 1, 1, 1));", "36\n" },
+		{ "fun f(n) { if (n < 1) return 0; var a = 1; var b = 2; return a + b + f(n - 1); } print f(50);", "150\n" },
+		{ "fun f(n) { var s = 0; for (var i = 0; i < n; i = i + 1) { var t = (i + (i * (i + (i - 1)))); s = s + t; } return s; } print f(3);", "10\n" },
+
+		// ===== call depth =====
+		{ "fun f(n) { if (n < 1) return 0; return 1 + f(n - 1); } print f(200);", "200\n", INTERPRET_OK, 0, 256 },
+		{ "class T { fun init(d) { this.d = d; } fun size() { if (this.d < 1) return 1; return 1 + T(this.d - 1).size(); } } print T(200).size();", "201\n", INTERPRET_OK, 0, 256 },
+		// The script frame plus f(254)'s 255 frames fill the limit exactly, one more call overflows.
+		{ "fun f(n) { if (n < 1) return 0; return 1 + f(n - 1); } print f(254);", "254\n", INTERPRET_OK, 0, 256 },
+		{ "fun f(n) { if (n < 1) return 0; return 1 + f(n - 1); } print f(255);", "Stack overflow", INTERPRET_RUNTIME_ERROR, 0, 256 },
+		{ "fun f() { f(); } f();", "Stack overflow", INTERPRET_RUNTIME_ERROR, 0, 256 },
+
+		// ===== tail calls =====
+		{ "fun loop(n, acc) { if (n < 1) return acc; return loop(n - 1, acc + 1); } print loop(2000, 0);", "2000\n", INTERPRET_OK, 0, 256 },
+		{ "fun even(n) { if (n < 1) return true; return odd(n - 1); } fun odd(n) { if (n < 1) return false; return even(n - 1); } print even(1001);", "false\n", INTERPRET_OK, 0, 256 },
+		{ "var keep; fun id(x) { return x; } fun f(a) { fun g() { return a; } keep = g; return id(a + 1); } print f(1); print keep();", "2\n1\n" },
+		{ "class P { fun init(x) { this.x = x; } } fun make(x) { return P(x); } print make(4).x;", "4\n" },
+		{ "fun f(a) { return a or f(true); } print f(false); print f(3);", "true\n3\n" },
+		{ "fun g(a, b) { return a; } fun f() { return g(1); } f();", "Expected 2 arguments but got 1.", INTERPRET_RUNTIME_ERROR },
+
+		// ===== call site cache =====
+		{ "fun a(x) { return x + 1; } fun b(x) { return x * 10; } var f = a; for (var i = 0; i < 4; i = i + 1) { print f(i); if (i == 1) f = b; }", "1\n2\n20\n30\n" },
+		{ "fun make(k) { fun add(x) { return x + k; } return add; } var fs = make(1); var gs = make(5); for (var i = 0; i < 2; i = i + 1) { var h = fs; if (i == 1) h = gs; print h(1); }", "2\n6\n" },
+		{ "class P { } fun f() { return 1; } var c = f; for (var i = 0; i < 3; i = i + 1) { var r = c(); if (i == 1) c = P; print r; }", "1\n1\n<instance of P>\n" },
+		{ "fun f(a) { return a; } fun g() { return 1; } var c = f; for (var i = 0; i < 2; i = i + 1) { c(1); c = g; }", "Expected 0 arguments but got 1.", INTERPRET_RUNTIME_ERROR },
+
+		// ===== object printing =====
+		{ "fun f() {} print f; print clock; class A { fun m() {} } print A().m; print A;", "<closure <fn f>>\n<closure <native fn clock>>\n<bound method <fn m> of <instance of A>>\n<class A>\n" },
+
+		// ===== caches across collections =====
+		{ "fun make(n) { class C { fun init() { this.y = 0; this.x = n; } fun get() { return this.x; } } return C(); } var s = 0; for (var i = 0; i < 20; i = i + 1) { s = s + make(i).get(); } print s;", "190\n" },
+		{ "fun make(n) { class C { fun init() { this.x = n; } } class D { fun init() { this.y = 0; this.x = n * 2; } } if (n < 5) return C(); return D(); } var s = 0; for (var i = 0; i < 10; i = i + 1) { s = s + make(i).x; } print s;", "80\n" },
+		{ "fun mk(k) { if (k) { fun f() { return 1; } return f; } fun g() { return 10; } return g; } var t = 0; var k = true; var c = 0; for (var i = 0; i < 30; i = i + 1) { var x = mk(k); c = c + 1; if (c == 3) { c = 0; t = t + x(); k = !k; } } print t;", "55\n" },
+
+		// ===== global slots =====
+		{ "print undefinedName;", "Undefined global variable 'undefinedName'.", INTERPRET_RUNTIME_ERROR },
+		{ "undefinedName = 1;", "Undefined global variable 'undefinedName'.", INTERPRET_RUNTIME_ERROR },
+		{ "fun f() { return later; } var later = 3; print f(); later = 4; print f();", "3\n4\n" },
+		{ "fun f() { return later2; } print f(); var later2 = 1;", "Undefined global variable 'later2'.", INTERPRET_RUNTIME_ERROR },
+
+		// ===== generational gc =====
+		{ "class B { } var a = B(); a.f = B(); var x = B(); x = B(); print a.f;", "<instance of B>\n" },
+		{ "class B { } var a = B(); var y = B(); y = B(); a.f = B(); y = B(); y = B(); y = B(); print a.f;", "<instance of B>\n" },
+		{ "class B { } var a = B(); var y = B(); y = B(); y = B(); y = B(); y = B(); a.f = B(); y = B(); y = B(); y = B(); print a.f;", "<instance of B>\n" },
+		{ "class B { } var a = B(); fun f() { var s = \"y\"; fun g() { return s; } s = s + \"z\"; return g; } var g = f(); var x = B(); x = B(); print g();", "yz\n" },
+		{ "var keep; fun outer() { var v = \"a\"; fun get() { return v; } keep = get; var x = \"b\" + \"c\"; v = x; } outer(); var y = \"d\" + \"e\"; print keep();", "bc\n" },
+		{ "class A { } var a = A(); class C < A { fun m() { return \"m\" + \"n\"; } } var x = C(); x = C(); print x.m();", "mn\n" },
+
+		// ===== cached initializer =====
+		{ "class P { fun init(a, b) { this.s = a + b; } } var t = 0; for (var i = 0; i < 100; i = i + 1) { t = t + P(i, 1).s; } print t;", "5050\n" },
+		{ "class A { fun init(x) { this.x = x; } } class B < A { } print B().x;", "Undefined property 'x'.", INTERPRET_RUNTIME_ERROR },
+		{ "class A { fun init(x) { this.x = x; } } class B < A { fun init() { super.init(7); } } var b = B(); print b.x;", "7\n" },
+		{ "class P { fun init(a) { this.a = a; } } P(1, 2);", "Expected 1 arguments but got 2.", INTERPRET_RUNTIME_ERROR },
+		{ "class P { fun init() { this.k = 1; } } var p = P(); print p.k; print p;", "1\n<instance of P>\n" },
+
+		// ===== inline fields =====
+		{ "class P { fun init(x, y) { this.x = x; this.y = y; } } var a = P(1, 2); var b = P(3, 4); b.z = 5; var c = P(6, 7); c.z = 8; c.w = 9; print a.x + a.y; print b.x + b.y + b.z; print c.x + c.y + c.z + c.w;", "3\n12\n30\n" },
+		{ "class K {} var old = K(); var young = nil; for (var i = 0; i < 3; i = i + 1) { var k = K(); k.a = 1; k.b = 2; k.c = 3; k.d = 4; k.e = 5; k.f = 6; k.g = 7; k.h = 8; k.i = 9; k.j = 10; young = k; } old.a = 100; old.j = 200; print young.a + young.e + young.j; print old.a + old.j;", "16\n300\n" },
+		{ MakeManyFieldsSource(), "1275\n" },
+
+		// ===== shapes =====
+		{ "class P { fun init(i) { if (i < 2) { this.a = i; } this.b = i * 10; } } var t = 0; for (var i = 0; i < 4; i = i + 1) { t = t + P(i).b; } var q = P(1); print q.a + q.b; print t;", "11\n60\n" },
+		{ "class P { fun init(i) { if (i < 2) { this.a = i; } } } var p = P(1); print p.a; p = P(3); print p.a;", "Undefined property 'a'.", INTERPRET_RUNTIME_ERROR },
+		{ "class P {} var x = P(); x.a = 1; x.b = 2; var y = P(); y.b = 3; y.a = 4; y.b = 5; fun sum(p) { return p.a * 10 + p.b; } print sum(x); print sum(y); print x[\"b\"] + y[\"b\"];", "12\n45\n7\n" },
+		{ "class K {} fun mk(n) { var k = K(); if (n > 0) k.a = 1; if (n > 1) k.b = 1; if (n > 2) k.c = 1; if (n > 3) k.d = 1; if (n > 4) k.e = 1; k.x = n; return k; } fun get(o) { return o.x; } var t = 0; for (var r = 0; r < 3; r = r + 1) { for (var n = 0; n < 6; n = n + 1) { t = t + get(mk(n)); } } print t;", "45\n" },
+		{ "class C { fun f() { return 1; } } fun g() { return 2; } fun call(o) { return o.f(); } var c = C(); var t = call(c); c.f = g; print t + call(c) * 10 + call(C()) * 100;", "121\n" },
+
+		// ===== method tables =====
+		{ "class A { fun a() { return 1; } } class B < A { fun b() { return 2; } } class C < B { fun a() { return 10; } } var c = C(); print c.a() + c.b(); print B().a();", "12\n1\n" },
+		{ "class A { fun m() { return \"A\"; } } class B < A { } class C < B { fun m() { return \"C\" + super.m(); } } print C().m();", "CA\n" },
+		{ MakeManyMethodsSource(), "877\n" },
+
+		// ===== string interning =====
+		{ "var a = \"ab\"; var b = \"a\" + \"b\"; print a == b; print a != \"ba\";", "true\ntrue\n" },
+		{ "var s = \"\"; for (var i = 0; i < 50; i = i + 1) { s = s + \"x\"; var t = s + \"y\"; } var u = \"\"; for (var i = 0; i < 50; i = i + 1) { u = u + \"x\"; } print s == u; print s + \"y\" == u + \"y\";", "true\ntrue\n" },
+		{ "class P { fun init() { this.name = \"n\" + \"m\"; } } var k = nil; for (var i = 0; i < 30; i = i + 1) { k = P(); } print k.name == \"nm\";", "true\n" },
+
+		// ===== gc stats =====
+		{ "var report = gcStats(); print report != nil; print report == report + \"\";", "true\ntrue\n" },
+		{ "gcStats(1);", "Expected 0 arguments but got 1.", INTERPRET_RUNTIME_ERROR },
+
+		// ===== heap limit =====
+		{ "class N { fun init(next) { this.next = next; } } var head = nil; for (var i = 0; i < 100000; i = i + 1) { head = N(head); }", "Out of memory, heap limit of 65536 bytes exceeded.", INTERPRET_RUNTIME_ERROR, 64 * 1024 },
+		{ "var s = \"ab\"; for (var i = 0; i < 30; i = i + 1) { s = s + s; }", "Out of memory, heap limit of 65536 bytes exceeded.", INTERPRET_RUNTIME_ERROR, 64 * 1024 },
+		{ "fun make(n) { fun f() { return n; } return f; } var t = 0; for (var i = 0; i < 20000; i = i + 1) { t = t + make(1)(); } print t;", "20000\n", INTERPRET_OK, 64 * 1024 },
+		{ "class N { fun init(next) { this.next = next; } } var head = nil; for (var i = 0; i < 20000; i = i + 1) { head = N(nil); } print \"done\";", "done\n", INTERPRET_OK, 64 * 1024 },
+		{ "class N { fun init(f, next) { this.f = f; this.next = next; } } fun mk() { var a = 1; var b = 2; var c = 3; var d = 4; fun f() { return a + b + c + d; } return f; } var head = nil; for (var i = 0; i < 100000; i = i + 1) { head = N(mk(), head); }", "Out of memory, heap limit of 65536 bytes exceeded.", INTERPRET_RUNTIME_ERROR, 64 * 1024 },
+		{ MakeFieldGrowthSource(), "Out of memory, heap limit of 65536 bytes exceeded.", INTERPRET_RUNTIME_ERROR, 64 * 1024 },
 	};
 
 #ifdef _WIN32
@@ -879,42 +1043,151 @@ void TestUnit::RunVMTest()
 	WORD& saved_attributes = colorGuard.savedAttributes;
 #endif
 
-	for (const auto& test : testCases)
+	// Every case runs once per configuration, neither the incremental nor the parallel
+	// collector may change observable behavior.
+	struct TestConfig
+	{
+		const char* name;
+		bool incrementalGC;
+		size_t gcWorkers;
+	};
+	// The parallel config marks on several threads however small the heap is.
+	const TestConfig testConfigs[] = {
+		{ "stop the world", false, 1 },
+		{ "incremental gc", true, 1 },
+		{ "parallel marking", false, 4 },
+	};
+	const VM::GCConfig defaultGCConfig = VM::GetInstance().GetGCConfig();
+	const uint32_t defaultMaxFrames = VM::GetInstance().GetMaxFrames();
+	for (const TestConfig& config : testConfigs)
 	{
-		printf("--- Testing VM: \"%s\" ---\n", test.source.c_str());
+		VM::GetInstance().SetIncrementalGC(config.incrementalGC);
+		VM::GetInstance().SetGCWorkerCount(config.gcWorkers, 0);
+		for (const auto& test : testCases)
+		{
+			printf("--- Testing VM (%s): \"%s\" ---\n", config.name, test.source.c_str());
 
-		VMRunResult runResult = RunVMWithCapture(test.source);
-		std::string expectedEscaped = EscapeForPrinting(test.expectedOutput);
-		std::string gotEscaped = EscapeForPrinting(runResult.output);
+			VM::GCConfig gcConfig = defaultGCConfig;
+			gcConfig.maxHeap = test.maxHeap;
+			VM::GetInstance().SetGCConfig(gcConfig);
+			VM::GetInstance().SetMaxFrames(test.maxFrames ? test.maxFrames : defaultMaxFrames);
 
-		bool passed = false;
-		if (test.expectedResult == INTERPRET_OK)
-		{
-			passed = (runResult.result == INTERPRET_OK && runResult.output == test.expectedOutput);
-		}
-		else
-		{
-			passed = (runResult.result == test.expectedResult && runResult.output.find(test.expectedOutput) != std::string::npos);
-		}
+			VMRunResult runResult = RunVMWithCapture(test.source);
+			std::string expectedEscaped = EscapeForPrinting(test.expectedOutput);
+			std::string gotEscaped = EscapeForPrinting(runResult.output);
 
-		if (passed)
-		{
-			printf("  [PASS] Expected: '%s', Got: '%s'\n", expectedEscaped.c_str(), gotEscaped.c_str());
+			bool passed = false;
+			if (test.expectedResult == INTERPRET_OK)
+			{
+				passed = (runResult.result == INTERPRET_OK && runResult.output == test.expectedOutput);
+			}
+			else
+			{
+				passed = (runResult.result == test.expectedResult && runResult.output.find(test.expectedOutput) != std::string::npos);
+			}
+
+			if (passed)
+			{
+				printf("  [PASS] Expected: '%s', Got: '%s'\n", expectedEscaped.c_str(), gotEscaped.c_str());
+			}
+			else
+			{
+#ifdef _WIN32
+				SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
+#endif
+				printf("  [FAIL] Expected: '%s', Got: '%s'\n", expectedEscaped.c_str(), gotEscaped.c_str());
+				printf("  [INFO] Result code: %d\n", (int)runResult.result);
+#ifdef _WIN32
+				if (IsDebuggerPresent()) __debugbreak();
+				SetConsoleTextAttribute(hConsole, saved_attributes);
+#endif
+			}
+			printf("----------------------------------------\n\n");
 		}
-		else
+
+		// The counters and the census are checked from C++, gcStats() only exposes them as text.
 		{
+			const char* statsSource = "class Keep { } class Temp { } var a = Keep(); var b = Keep(); var c = Keep(); for (var i = 0; i < 100; i = i + 1) { var t = Temp(); }";
+			printf("--- Testing VM (%s) GetGCStats: \"%s\" ---\n", config.name, statsSource);
+			VM::GetInstance().SetGCConfig(defaultGCConfig);
+			VM::GetInstance().SetMaxFrames(defaultMaxFrames);
+			VMRunResult runResult = RunVMWithCapture(statsSource);
+			VM::GetInstance().CollectAllGarbage();
+			VM::GCStats stats = VM::GetInstance().GetGCStats();
+			// Only the three Keep instances held by globals survive the collection.
+			bool passed = runResult.result == INTERPRET_OK &&
+				(stats.full.count > 0 || stats.minor.count > 0) &&
+				stats.pauseCount > 0 &&
+				stats.objectCounts[TYPE_INSTANCE] == 3;
+			if (passed)
+			{
+				printf("  [PASS] collections: %llu minor, %llu full, pauses: %llu, instances: %zu\n",
+					(unsigned long long)stats.minor.count, (unsigned long long)stats.full.count, (unsigned long long)stats.pauseCount, stats.objectCounts[TYPE_INSTANCE]);
+			}
+			else
+			{
 #ifdef _WIN32
-			SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
+				SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
 #endif
-			printf("  [FAIL] Expected: '%s', Got: '%s'\n", expectedEscaped.c_str(), gotEscaped.c_str());
-			printf("  [INFO] Result code: %d\n", (int)runResult.result);
+				printf("  [FAIL] collections: %llu minor, %llu full, pauses: %llu, instances: %zu (expected 3)\n",
+					(unsigned long long)stats.minor.count, (unsigned long long)stats.full.count, (unsigned long long)stats.pauseCount, stats.objectCounts[TYPE_INSTANCE]);
+				printf("  [INFO] Result code: %d\n", (int)runResult.result);
 #ifdef _WIN32
-			if (IsDebuggerPresent()) __debugbreak();
-			SetConsoleTextAttribute(hConsole, saved_attributes);
+				if (IsDebuggerPresent()) __debugbreak();
+				SetConsoleTextAttribute(hConsole, saved_attributes);
 #endif
+			}
+			printf("----------------------------------------\n\n");
+		}
+	}
+
+	// Grow factors that are not finite or would not grow the heap fall back to the default.
+	{
+		printf("--- Testing VM GCConfig grow factor validation ---\n");
+		const double defaultFactor = VM::GCConfig().growFactor;
+		const double requested[] = { std::nan(""), INFINITY, 1.0, 0.5, 1.5 };
+		const double expected[] = { defaultFactor, defaultFactor, defaultFactor, defaultFactor, 1.5 };
+		bool passed = true;
+		for (size_t i = 0; i < sizeof(requested) / sizeof(requested[0]); ++i)
+		{
+			VM::GCConfig gcConfig = defaultGCConfig;
+			gcConfig.growFactor = requested[i];
+			VM::GetInstance().SetGCConfig(gcConfig);
+			double applied = VM::GetInstance().GetGCConfig().growFactor;
+			if (applied != expected[i])
+			{
+				printf("  [FAIL] Requested %f, applied %f, expected %f\n", requested[i], applied, expected[i]);
+				passed = false;
+			}
 		}
+		if (passed)
+		{
+			printf("  [PASS] Invalid grow factors replaced by %f\n", defaultFactor);
+		}
+		printf("----------------------------------------\n\n");
+	}
+
+	// Arena pages emptied by a spike go back to the system, at most one page per size class stays.
+	{
+		const char* spikeSource = "class N { fun init(next) { this.next = next; } } var head = nil; for (var i = 0; i < 20000; i = i + 1) { head = N(head); }";
+		printf("--- Testing VM arena pages: \"%s\" ---\n", spikeSource);
+		VM::GetInstance().SetGCConfig(defaultGCConfig);
+		VM::GetInstance().Reset();
+		size_t pagesBefore = ValueArena::GetInstance().GetPageCount();
+		VMRunResult runResult = RunVMWithCapture(spikeSource);
+		size_t pagesAtPeak = ValueArena::GetInstance().GetPageCount();
+		VM::GetInstance().Reset();
+		size_t pagesAfter = ValueArena::GetInstance().GetPageCount();
+		bool passed = runResult.result == INTERPRET_OK && pagesAtPeak > pagesBefore + 8 &&
+			pagesAfter <= pagesBefore + ValueArena::CLASS_COUNT && pagesAfter < pagesAtPeak;
+		printf("  [%s] pages: %zu before, %zu at peak, %zu after reset\n", passed ? "PASS" : "FAIL", pagesBefore, pagesAtPeak, pagesAfter);
 		printf("----------------------------------------\n\n");
 	}
+
+	VM::GetInstance().SetIncrementalGC(false);
+	VM::GetInstance().SetGCWorkerCount(1);
+	VM::GetInstance().SetGCConfig(defaultGCConfig);
+	VM::GetInstance().SetMaxFrames(defaultMaxFrames);
 }
 
 // 辅助函数：运行解析器并捕获语义错误
@@ -6,16 +6,22 @@
 #include <cstdarg>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdlib>
+#include <cassert>
+#include <cmath>
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
-// #define USE_LOCAL_IP
 
-namespace
-{
-	constexpr size_t INVALID_GLOBAL_SLOT = (size_t)-1;
-}
+// Threaded dispatch relies on the "labels as values" extension, other compilers fall back to the switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_THREADED_DISPATCH
+#endif
 
 static VMValue clock(int argCount, VMValue* args)
 {
@@ -24,8 +30,161 @@ static VMValue clock(int argCount, VMValue* args)
 	return VMValue(elapsed.count());
 }
 
+// Report of the collector stats, for sizing heaps and spotting leaks from a script.
+static VMValue gcStatsNative(int argCount, VMValue* args)
+{
+	VMValue report = VM::CreateString(VM::GetInstance().GetGCStats().ToString());
+	return report.AsObject() ? report : VMValue::Nil();
+}
+
 VM* VM::instance = nullptr;
 
+namespace
+{
+	// Value of an environment variable, empty if it is not set.
+	std::string ReadEnvironment(const char* name)
+	{
+#ifdef _WIN32
+		char* buffer = nullptr;
+		size_t length = 0;
+		if (_dupenv_s(&buffer, &length, name) != 0 || buffer == nullptr)
+		{
+			return std::string();
+		}
+		std::string value(buffer);
+		free(buffer);
+		return value;
+#else
+		const char* value = getenv(name);
+		return value ? std::string(value) : std::string();
+#endif
+	}
+
+	// Parse a byte count such as "65536", "512K" or "2M". Leaves result untouched if the text is not one.
+	void ReadSizeEnvironment(const char* name, size_t& result)
+	{
+		std::string text = ReadEnvironment(name);
+		if (text.empty())
+		{
+			return;
+		}
+		char* end = nullptr;
+		unsigned long long size = strtoull(text.c_str(), &end, 10);
+		if (end == text.c_str())
+		{
+			return;
+		}
+		switch (*end)
+		{
+			case 'k': case 'K': size <<= 10; ++end; break;
+			case 'm': case 'M': size <<= 20; ++end; break;
+			case 'g': case 'G': size <<= 30; ++end; break;
+			default: break;
+		}
+		if (*end == '\0')
+		{
+			result = (size_t)size;
+		}
+	}
+
+	void ReadFactorEnvironment(const char* name, double& result)
+	{
+		std::string text = ReadEnvironment(name);
+		if (text.empty())
+		{
+			return;
+		}
+		char* end = nullptr;
+		double factor = strtod(text.c_str(), &end);
+		if (end != text.c_str() && *end == '\0')
+		{
+			result = factor;
+		}
+	}
+
+	template <typename T>
+	void BlackenAs(VM& vm, VMObject* object)
+	{
+		static_cast<T*>(object)->Blacken(vm);
+	}
+
+	void BlackenNothing(VM& vm, VMObject* object)
+	{
+		(void)vm;
+		(void)object;
+	}
+
+	template <typename T>
+	size_t SizeAs(const VMObject* object)
+	{
+		return static_cast<const T*>(object)->Size();
+	}
+
+	template <typename T>
+	std::string ToStringAs(const VMObject* object)
+	{
+		return static_cast<const T*>(object)->ToString();
+	}
+
+	template <typename T>
+	void DestroyAs(VMObject* object)
+	{
+		delete static_cast<T*>(object);
+	}
+
+	Chunk* NoChunk(const VMObject* object)
+	{
+		(void)object;
+		return nullptr;
+	}
+
+	Chunk* FunctionChunk(const VMObject* object)
+	{
+		return static_cast<const Compiler::VMFunctionBase*>(object)->GetChunk();
+	}
+
+	void DestroyFunction(VMObject* object)
+	{
+		static_cast<Compiler::VMFunctionBase*>(object)->Destroy();
+	}
+
+	void DestroyInstance(VMObject* object)
+	{
+		static_cast<Compiler::VMInstanceValue*>(object)->Destroy();
+	}
+
+	template <typename T>
+	constexpr VMObjectOps LeafOps()
+	{
+		return { &BlackenNothing, &SizeAs<T>, &NoChunk, &ToStringAs<T>, &DestroyAs<T> };
+	}
+
+	template <typename T>
+	constexpr VMObjectOps TracedOps()
+	{
+		return { &BlackenAs<T>, &SizeAs<T>, &NoChunk, &ToStringAs<T>, &DestroyAs<T> };
+	}
+
+	// Numbers, booleans and nil are immediates inside VMValue and never reach the heap.
+	constexpr VMObjectOps NoOps = { nullptr, nullptr, nullptr, nullptr, nullptr };
+}
+
+// In ValueType order.
+const VMObjectOps vmObjectOps[TYPE_ERROR + 1] = {
+	NoOps, // TYPE_INT
+	NoOps, // TYPE_FLOAT
+	LeafOps<VMStringValue>(), // TYPE_STRING
+	NoOps, // TYPE_BOOL
+	NoOps, // TYPE_NIL
+	{ &BlackenAs<Compiler::VMFunctionBase>, &SizeAs<Compiler::VMFunctionBase>, &FunctionChunk, &ToStringAs<Compiler::VMFunctionBase>, &DestroyFunction }, // TYPE_CALLABLE
+	TracedOps<Compiler::VMClassValue>(), // TYPE_CLASS
+	{ &BlackenAs<Compiler::VMInstanceValue>, &SizeAs<Compiler::VMInstanceValue>, &NoChunk, &ToStringAs<Compiler::VMInstanceValue>, &DestroyInstance }, // TYPE_INSTANCE
+	TracedOps<VM::UpvalueValue>(), // TYPE_UPVALUE
+	TracedOps<Compiler::BoundMethodValue>(), // TYPE_BOUND_METHOD
+	TracedOps<VM::InnerValue>(), // TYPE_INNER_VALUE
+	NoOps, // TYPE_ERROR
+};
+
 void VM::UpvalueValue::Blacken(VM& vm)
 {
 	if (location != nullptr)
@@ -95,21 +254,25 @@ void VM::AdjustFrameSlots(VMValue* oldStacks, VMValue* newStacks)
 	}
 }
 
-void VM::Push(VMValue value)
+void VM::EnsureStackCapacity(size_t slotCount)
 {
 	// Allocate the stack lazily so empty VMs do not pay the upfront cost.
 	if (stacks == nullptr)
 	{
-		stackCapacity = STACK_MAX;
+		stackCapacity = INITIAL_STACK_CAPACITY;
 		stacks = GROW_ARRAY(VMValue, (VMValue*)nullptr, 0, stackCapacity);
 		stackTop = stacks;
 	}
 
 	size_t count = (size_t)(stackTop - stacks);
-	if (count + 1 > stackCapacity)
+	if (count + slotCount > stackCapacity)
 	{
 		size_t oldCapacity = stackCapacity;
 		size_t newCapacity = oldCapacity * 2;
+		while (count + slotCount > newCapacity)
+		{
+			newCapacity *= 2;
+		}
 		VMValue* oldStacks = stacks;
 		VMValue* newStacks = GROW_ARRAY(VMValue, stacks, oldCapacity, newCapacity);
 		// Growing the stack can move the buffer, so every frame slot pointer must be rebased.
@@ -118,7 +281,28 @@ void VM::Push(VMValue value)
 		stackTop = stacks + count;
 		stackCapacity = newCapacity;
 	}
+}
+
+CallFrame* VM::PushFrame(const uint8_t* instructionIp)
+{
+	if (frameCount >= maxFrames)
+	{
+		RuntimeError(instructionIp, "Stack overflow: too many nested calls.");
+		return nullptr;
+	}
+
+	if (frameCount == frameCapacity)
+	{
+		uint32_t newCapacity = frameCapacity == 0 ? INITIAL_FRAME_CAPACITY : frameCapacity * 2;
+		frames = GROW_ARRAY(CallFrame, frames, frameCapacity, newCapacity);
+		frameCapacity = newCapacity;
+	}
+	return &frames[frameCount++];
+}
 
+void VM::Push(VMValue value)
+{
+	EnsureStackCapacity(1);
 	*stackTop++ = value;
 }
 
@@ -131,22 +315,8 @@ VMValue VM::Pop()
 		exit(1);
 	}
 
-	VMValue value = *--stackTop;
-	size_t count = (size_t)(stackTop - stacks);
-	if (stackCapacity > STACK_MAX && count <= stackCapacity / 4)
-	{
-		size_t oldCapacity = stackCapacity;
-		size_t newCapacity = oldCapacity / 2;
-		if (newCapacity < STACK_MAX) newCapacity = STACK_MAX;
-		VMValue* oldStacks = stacks;
-		VMValue* newStacks = GROW_ARRAY(VMValue, stacks, oldCapacity, newCapacity);
-		stacks = newStacks;
-		AdjustFrameSlots(oldStacks, newStacks);
-		stackTop = stacks + count;
-		stackCapacity = newCapacity;
-	}
-
-	return value;
+	// The buffer is kept at its high-water mark, shrinking here used to realloc at every recursion boundary.
+	return *--stackTop;
 }
 
 VMValue VM::Peek(int32_t distance)
@@ -162,89 +332,35 @@ VMValue VM::Peek(int32_t distance)
 
 bool VM::IsNumber(VMValue value)
 {
-	return value.type == TYPE_INT || value.type == TYPE_FLOAT;
+	return value.IsNumber();
 }
 
 bool VM::IsFalsey(VMValue value)
 {
-	return value.type == TYPE_NIL || value.type == TYPE_ERROR ||
-		(value.type == TYPE_BOOL && !value.boolean) ||
-		(value.type == TYPE_STRING && static_cast<StringValue*>(value.object)->value.empty());
+	return value.IsNil() || !value.IsValid() ||
+		(value.IsBool() && !value.AsBool()) ||
+		(value.IsObjectType(TYPE_STRING) && static_cast<VMStringValue*>(value.AsObject())->value.empty()) ||
+		value.IsObjectType(TYPE_ERROR);
 }
 
 bool VM::IsString(VMValue value)
 {
-	return value.type == TYPE_STRING && value.object;
-}
-
-bool VM::ResolveOrCreateGlobalSlot(VMValue nameValue, size_t& outSlot, const uint8_t* instructionIp)
-{
-	if (!IsString(nameValue))
-	{
-		RuntimeError(instructionIp, "Global variable name must be a string.");
-		return false;
-	}
-
-	StringValue* stringValue = static_cast<StringValue*>(nameValue.object);
-	size_t cachedSlot = stringValue->cachedGlobalSlot;
-	if (cachedSlot != INVALID_GLOBAL_SLOT && cachedSlot < globalSlots.size())
-	{
-		outSlot = cachedSlot;
-		return true;
-	}
-
-	auto it = globalNameToSlot.find(stringValue->value);
-	if (it == globalNameToSlot.end())
-	{
-		size_t newSlot = globalSlots.size();
-		globalNameToSlot[stringValue->value] = newSlot;
-		globalSlots.push_back(VMValue());
-		stringValue->cachedGlobalSlot = newSlot;
-		outSlot = newSlot;
-		return true;
-	}
-
-	outSlot = it->second;
-	if (outSlot >= globalSlots.size())
-	{
-		globalSlots.resize(outSlot + 1);
-	}
-	stringValue->cachedGlobalSlot = outSlot;
-	return true;
+	return value.IsObjectType(TYPE_STRING);
 }
 
-bool VM::ResolveExistingGlobalSlot(VMValue nameValue, size_t& outSlot, const uint8_t* instructionIp)
+size_t VM::ReserveGlobalSlot(const std::string& name)
 {
-	if (!IsString(nameValue))
-	{
-		RuntimeError(instructionIp, "Global variable name must be a string.");
-		return false;
-	}
-
-	StringValue* stringValue = static_cast<StringValue*>(nameValue.object);
-	size_t cachedSlot = stringValue->cachedGlobalSlot;
-	if (cachedSlot != INVALID_GLOBAL_SLOT && cachedSlot < globalSlots.size())
-	{
-		outSlot = cachedSlot;
-		return true;
-	}
-
-	auto it = globalNameToSlot.find(stringValue->value);
-	if (it == globalNameToSlot.end())
-	{
-		RuntimeError(instructionIp, "Undefined global variable '%s'.", stringValue->value.c_str());
-		return false;
-	}
-
-	outSlot = it->second;
-	if (outSlot >= globalSlots.size())
+	auto it = globalNameToSlot.find(name);
+	if (it != globalNameToSlot.end())
 	{
-		RuntimeError(instructionIp, "Undefined global variable '%s'.", stringValue->value.c_str());
-		return false;
+		return it->second;
 	}
 
-	stringValue->cachedGlobalSlot = outSlot;
-	return true;
+	size_t slot = globalSlots.size();
+	globalNameToSlot[name] = slot;
+	globalNames.push_back(name);
+	globalSlots.push_back(VMValue());
+	return slot;
 }
 
 void VM::RuntimeErrorImpl(const uint8_t* instructionIp, const char* format, va_list args)
@@ -281,6 +397,7 @@ void VM::RuntimeErrorImpl(const uint8_t* instructionIp, const char* format, va_l
 		UpvalueValue* upvalue = openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		WriteBarrier(upvalue, upvalue->closed);
 		openUpvalues = upvalue->nextUpvalue;
 		upvalue->nextUpvalue = nullptr;
 	}
@@ -305,6 +422,11 @@ void VM::RuntimeError(const uint8_t* instructionIp, const char* format, ...)
 	va_end(args);
 }
 
+void VM::HeapLimitError(const uint8_t* instructionIp)
+{
+	RuntimeError(instructionIp, "Out of memory, heap limit of %zu bytes exceeded.", gcConfig.maxHeap);
+}
+
 InterpretResult VM::Negate(const uint8_t* instructionIp)
 {
 	if (stacks == nullptr || stackTop == stacks)
@@ -320,25 +442,32 @@ InterpretResult VM::Negate(const uint8_t* instructionIp)
 	}
 
 	VMValue top = *(stackTop - 1);
-	*(stackTop - 1) = top.type == TYPE_INT ? VMValue(-top.integer) : VMValue(-top.number);
+	*(stackTop - 1) = top.IsInt() ? VMValue(-top.AsInt()) : VMValue(-top.AsFloat());
 	return INTERPRET_OK;
 }
 
 void VM::Init()
 {
 	objects = nullptr;
+	youngObjects = nullptr;
+	youngBytes = 0;
 	openUpvalues = nullptr;
 	frameCount = 0;
 	bytesAllocated = 0;
-	nextGC = INITIAL_GC_THRESHOLD;
+	nextGC = ClampGCThreshold(gcConfig.initialThreshold);
+	gcStats = GCStats();
+	gcStatsStart = std::chrono::steady_clock::now();
 	ResetStack();
+	initString = static_cast<VMStringValue*>(CreateString("init").AsObject());
 	DefineNative("clock", clock, 0);
+	DefineNative("gcStats", gcStatsNative, 0);
 }
 
 void VM::Reset()
 {
 	Free();
 	globalNameToSlot.clear();
+	globalNames.clear();
 	globalSlots.clear();
 	compilerRoots.clear();
 	Init();
@@ -346,10 +475,27 @@ void VM::Reset()
 
 void VM::Free()
 {
+	// Every string goes below, no need to unlink them one at a time.
+	strings.Clear();
+	initString = nullptr;
 	while (objects != nullptr)
 	{
+		VMObject* next = objects->nextGCValue;
 		FreeValue(objects);
+		objects = next;
 	}
+	while (youngObjects != nullptr)
+	{
+		VMObject* next = youngObjects->nextGCValue;
+		FreeValue(youngObjects);
+		youngObjects = next;
+	}
+	youngBytes = 0;
+	rememberedSet.clear();
+	gcPhase = GC_PHASE_IDLE;
+	gcDebt = 0;
+	sweepCursor = nullptr;
+	sweepPrevious = nullptr;
 
 	if (stacks != nullptr)
 	{
@@ -359,9 +505,17 @@ void VM::Free()
 	stackTop = nullptr;
 	stackCapacity = 0;
 
+	if (frames != nullptr)
+	{
+		FREE_ARRAY(CallFrame, frames, frameCapacity);
+		frames = nullptr;
+	}
+	frameCapacity = 0;
+	frameCount = 0;
+
 	if (grayStack != nullptr)
 	{
-		FREE_ARRAY(Value*, grayStack, grayStackCapacity);
+		FREE_ARRAY(VMObject*, grayStack, grayStackCapacity);
 		grayStack = nullptr;
 	}
 	grayStackCapacity = 0;
@@ -369,31 +523,26 @@ void VM::Free()
 	bytesAllocated = 0;
 }
 
-void VM::FreeValue(Value* object)
+void VM::FreeValue(VMObject* object)
 {
 	if (object == nullptr)
 	{
 		return;
 	}
 
-	// Remove from the intrusive linked list before deleting
-	if (objects == object)
+	if (object->type == TYPE_CALLABLE && static_cast<Compiler::VMFunctionBase*>(object)->GetType() == Compiler::VM_FUNC_CLOSURE &&
+		static_cast<Compiler::VMClosureValue*>(object)->isCallCached)
 	{
-		objects = object->nextGCValue;
+		// A new closure may take this address, so every call cache filled so far is retired.
+		++closureEpoch;
 	}
-	else
+
+	if (object->type == TYPE_STRING)
 	{
-		for (Value* curr = objects; curr != nullptr; curr = curr->nextGCValue)
-		{
-			if (curr->nextGCValue == object)
-			{
-				curr->nextGCValue = object->nextGCValue;
-				break;
-			}
-		}
+		strings.Remove(static_cast<VMStringValue*>(object));
 	}
 
-	size_t objectSize = object->Size();
+	size_t objectSize = ObjectSize(object);
 	if (objectSize <= bytesAllocated)
 	{
 		bytesAllocated -= objectSize;
@@ -411,26 +560,110 @@ void VM::FreeValue(Value* object)
 		bytesAllocated);
 #endif
 
-	delete object;
+	DestroyObject(object);
+}
+
+bool VM::ReserveHeap(size_t bytes)
+{
+	// The cap only fails allocations of running code, the compiler has no way to back out of a half built function.
+	if (gcConfig.maxHeap != 0 && bytesAllocated + bytes > gcConfig.maxHeap && compilerRoots.empty())
+	{
+		CollectAllGarbage();
+		return bytesAllocated + bytes <= gcConfig.maxHeap;
+	}
+	return true;
+}
+
+bool VM::ChargeGrowth(VMObject* object, size_t bytes)
+{
+	if (!ReserveHeap(bytes))
+	{
+		return false;
+	}
+	bytesAllocated += bytes;
+	if (!object->isOld)
+	{
+		youngBytes += bytes;
+	}
+	gcStats.allocatedBytes += bytes;
+	return true;
 }
 
-Value* VM::AllocValue(Value* value)
+VMObject* VM::AllocValue(VMObject* value)
 {
 	if (!value) return nullptr;
-	size_t objectSize = value->Size();
+	size_t objectSize = ObjectSize(value);
+
+	if (!ReserveHeap(objectSize))
+	{
+		DestroyObject(value);
+		return nullptr;
+	}
 
 #ifdef DEBUG_STRESS_GC
-	CollectGarbage();
-#endif
-	if (bytesAllocated + objectSize > nextGC)
+	// Alternate so both collectors run against every allocation site.
+	static uint32_t stressCollections = 0;
+	if (gcPhase != GC_PHASE_IDLE)
+	{
+		// Smallest possible slices, so a cycle interleaves with as much execution as possible.
+		GCSlice(1);
+	}
+	if ((stressCollections++ & 1) == 0)
+	{
+		CollectYoungGarbage();
+	}
+	else if (gcPhase != GC_PHASE_IDLE)
+	{
+		// A cycle is still running, the slice above already advanced it.
+	}
+	else if (incrementalGC)
+	{
+		StartGCCycle();
+	}
+	else
 	{
 		CollectGarbage();
 	}
+#endif
+	if (gcPhase != GC_PHASE_IDLE)
+	{
+		gcDebt += objectSize;
+		if (gcDebt >= gcSliceBytes)
+		{
+			GCSlice(gcDebt * GC_SLICE_WORK_FACTOR);
+			gcDebt = 0;
+		}
+	}
+	else if (bytesAllocated + objectSize > nextGC)
+	{
+		if (incrementalGC)
+		{
+			StartGCCycle();
+		}
+		else
+		{
+			CollectGarbage();
+		}
+	}
+	// The nursery keeps being collected while old objects wait to be swept.
+	if (gcPhase != GC_PHASE_MARK && youngBytes + objectSize > NURSERY_SIZE)
+	{
+		CollectYoungGarbage();
+	}
 
-	value->nextGCValue = objects;
-	value->markedValue = !currentMarkValue;
-	objects = value;
+	// New objects start in the nursery.
+	value->nextGCValue = youngObjects;
+	value->markedValue.store(!currentMarkValue, std::memory_order_relaxed);
+	youngObjects = value;
 	bytesAllocated += objectSize;
+	youngBytes += objectSize;
+	gcStats.allocatedBytes += objectSize;
+
+	// Objects born while marking are grayed so the references their constructors set get traced.
+	if (gcPhase == GC_PHASE_MARK)
+	{
+		MarkValue(VMValue(value));
+	}
 
 #ifdef DEBUG_LOG_GC
 	printf("  Allocated object %p of type %s (%zu bytes, %zu total)\n",
@@ -443,40 +676,70 @@ Value* VM::AllocValue(Value* value)
 	return value;
 }
 
+void VM::SetMaxFrames(uint32_t inMaxFrames)
+{
+	// At least the script frame must fit.
+	maxFrames = inMaxFrames < 1 ? 1 : inMaxFrames;
+}
+
+VMValue VM::Create(VMObject* object)
+{
+	object = GetInstance().AllocValue(object);
+	return object ? VMValue(object) : VMValue();
+}
+
+VMValue VM::CreateString(std::string chars)
+{
+	VM& vm = GetInstance();
+	uint32_t hash = HashString(chars.data(), chars.size());
+	VMStringValue* interned = vm.strings.Find(chars.data(), chars.size(), hash);
+	if (interned != nullptr)
+	{
+		// An unmarked old string is dead but not swept yet, it is about to be referenced again so it survives the sweep.
+		if (vm.gcPhase == GC_PHASE_SWEEP && interned->isOld && interned->markedValue.load(std::memory_order_relaxed) != vm.currentMarkValue)
+		{
+			interned->markedValue.store(vm.currentMarkValue, std::memory_order_relaxed);
+		}
+		return VMValue(interned);
+	}
+	VMValue string = Create(new VMStringValue(std::move(chars), hash));
+	if (string.AsObject())
+	{
+		vm.strings.Add(static_cast<VMStringValue*>(string.AsObject()));
+	}
+	return string;
+}
+
 VMValue VM::Create(Value* value)
 {
 	if (value == nullptr)
 	{
 		return VMValue();
 	}
+	VMValue result;
 	switch (value->type)
 	{
 		case TYPE_INT:
-		{
-			int result = static_cast<IntValue*>(value)->value;
-			delete value;
-			return VMValue(result);
-		}
+			result = VMValue(static_cast<IntValue*>(value)->value);
+			break;
 		case TYPE_FLOAT:
-		{
-			float result = static_cast<FloatValue*>(value)->value;
-			delete value;
-			return VMValue(result);
-		}
+			result = VMValue(static_cast<FloatValue*>(value)->value);
+			break;
 		case TYPE_BOOL:
-		{
-			bool result = static_cast<BoolValue*>(value)->value;
-			delete value;
-			return VMValue(result);
-		}
+			result = VMValue(static_cast<BoolValue*>(value)->value);
+			break;
 		case TYPE_NIL:
-			delete value;
-			return VMValue::Nil();
+			result = VMValue::Nil();
+			break;
+		case TYPE_STRING:
+			result = CreateString(static_cast<StringValue*>(value)->value);
+			break;
 		default:
+			// Other tree-walk values have no VM counterpart.
 			break;
 	}
-	Value* object = GetInstance().AllocValue(value);
-	return object ? VMValue(object) : VMValue();
+	delete value;
+	return result;
 }
 
 VMValue VM::CaptureUpvalue(VMValue* local)
@@ -495,9 +758,13 @@ VMValue VM::CaptureUpvalue(VMValue* local)
 		return VMValue(upvalue);
 	}
 
-	UpvalueValue* uv = new UpvalueValue(local);
+	UpvalueValue* uv = static_cast<UpvalueValue*>(AllocValue(new UpvalueValue(local)));
+	if (uv == nullptr)
+	{
+		// Over the heap cap, the caller reports it.
+		return VMValue();
+	}
 	uv->location = local;
-	AllocValue(uv);
 	uv->nextUpvalue = upvalue;
 
 	if (previousUpvalue)
@@ -525,47 +792,231 @@ void VM::CloseUpvalues(VMValue* last)
 		upvalue->closed = *upvalue->location;
 		// Set the location to the closed value.
 		upvalue->location = &upvalue->closed;
+		WriteBarrier(upvalue, upvalue->closed);
 		openUpvalues = upvalue->nextUpvalue;
 		upvalue->nextUpvalue = nullptr;
 	}
 }
 
+// Pick the type-specialized form of a generic arithmetic opcode for the operand types seen at a site.
+// Returns the generic opcode itself when no specialization exists.
+static uint8_t QuickenBinaryOp(uint8_t op, VMValue a, VMValue b)
+{
+	bool bothIntegers = a.IsInt() && b.IsInt();
+	bool bothFloats = a.IsFloat() && b.IsFloat();
+	switch (op)
+	{
+		case OP_ADD:
+			if (bothIntegers) return OP_ADD_II;
+			if (bothFloats) return OP_ADD_FF;
+			if (a.IsObjectType(TYPE_STRING) && b.IsObjectType(TYPE_STRING)) return OP_ADD_SS;
+			break;
+		case OP_SUBTRACT:
+			if (bothIntegers) return OP_SUBTRACT_II;
+			if (bothFloats) return OP_SUBTRACT_FF;
+			break;
+		case OP_MULTIPLY:
+			if (bothIntegers) return OP_MULTIPLY_II;
+			if (bothFloats) return OP_MULTIPLY_FF;
+			break;
+		case OP_GREATER:
+			if (bothIntegers) return OP_GREATER_II;
+			if (bothFloats) return OP_GREATER_FF;
+			break;
+		case OP_LESS:
+			if (bothIntegers) return OP_LESS_II;
+			if (bothFloats) return OP_LESS_FF;
+			break;
+		default:
+			break;
+	}
+	return op;
+}
+
 InterpretResult VM::Run()
 {
-#ifdef USE_LOCAL_IP
-	uint8_t* ip = frames[frameCount - 1].ip;
-#define IP ip
+	// The hot state of the running frame is kept in locals. It is only written back to the
+	// CallFrame when control leaves the frame (calls, returns) and reloaded once it comes back.
+	CallFrame* frame = nullptr;
+	uint8_t* ip = nullptr;
+	Chunk* chunk = nullptr;
+	VMValue* constants = nullptr;
+	// VM::Call reserves every frame's maximum stack depth, so the stack only moves across calls.
+	VMValue* slots = nullptr;
+	uint8_t opCode = OP_NOP;
+
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_FRAME() \
+	do \
+	{ \
+		frame = &frames[frameCount - 1]; \
+		ip = frame->ip; \
+		chunk = frame->GetChunk(); \
+		constants = chunk->constants.values; \
+		slots = frame->slots; \
+	} while (0)
+
+	// Unchecked stack access for the dispatch loop, capacity is guaranteed by VM::Call.
+#define PUSH(value) \
+	do \
+	{ \
+		VMValue pushedValue = (value); \
+		*stackTop++ = pushedValue; \
+	} while (0)
+#define POP() (*--stackTop)
+	// Discard the top value, POP is only for values that are used.
+#define DROP() ((void)--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+	do \
+	{ \
+		printf("> "); \
+		chunk->DisassembleInstruction((int32_t)(ip - chunk->code), frameCount - 1); \
+	} while (0)
 #else
-#define IP frames[frameCount - 1].ip
+#define TRACE_INSTRUCTION() do {} while (0)
 #endif
 
+#ifdef USE_THREADED_DISPATCH
+	// Indexed by OpCode, so the order must match the enum in Chunk.h exactly.
+	static void* dispatchTable[] =
+	{
+		&&TARGET_OP_CONSTANT,
+		&&TARGET_OP_CONSTANT_LONG,
+		&&TARGET_OP_NIL,
+		&&TARGET_OP_TRUE,
+		&&TARGET_OP_FALSE,
+		&&TARGET_OP_NEGATE,
+		&&TARGET_OP_PRINT,
+		&&TARGET_OP_ADD,
+		&&TARGET_OP_SUBTRACT,
+		&&TARGET_OP_MULTIPLY,
+		&&TARGET_OP_DIVIDE,
+		&&TARGET_OP_NOT,
+		&&TARGET_OP_DEFINE_GLOBAL,
+		&&TARGET_OP_DEFINE_GLOBAL_LONG,
+		&&TARGET_OP_GET_LOCAL,
+		&&TARGET_OP_GET_LOCAL_LONG,
+		&&TARGET_OP_SET_LOCAL,
+		&&TARGET_OP_SET_LOCAL_LONG,
+		&&TARGET_OP_POP,
+		&&TARGET_OP_DUP,
+		&&TARGET_OP_NOP,
+		&&TARGET_OP_GET_GLOBAL,
+		&&TARGET_OP_GET_GLOBAL_LONG,
+		&&TARGET_OP_SET_GLOBAL,
+		&&TARGET_OP_SET_GLOBAL_LONG,
+		&&TARGET_OP_EQUAL,
+		&&TARGET_OP_GREATER,
+		&&TARGET_OP_LESS,
+		&&TARGET_OP_JUMP_IF_FALSE,
+		&&TARGET_OP_JUMP,
+		&&TARGET_OP_LOOP,
+		&&TARGET_OP_CALL,
+		&&TARGET_OP_INVOKE,
+		&&TARGET_OP_INVOKE_LONG,
+		&&TARGET_OP_ROOT_INVOKE,
+		&&TARGET_OP_ROOT_INVOKE_LONG,
+		&&TARGET_OP_INNER_INVOKE,
+		&&TARGET_OP_CLOSURE,
+		&&TARGET_OP_GET_UPVALUE,
+		&&TARGET_OP_SET_UPVALUE,
+		&&TARGET_OP_CLOSE_UPVALUE,
+		&&TARGET_OP_CLASS,
+		&&TARGET_OP_SET_PROPERTY,
+		&&TARGET_OP_GET_PROPERTY,
+		&&TARGET_OP_SET_PROPERTY_LONG,
+		&&TARGET_OP_GET_PROPERTY_LONG,
+		&&TARGET_OP_GET_INDEX,
+		&&TARGET_OP_SET_INDEX,
+		&&TARGET_OP_METHOD,
+		&&TARGET_OP_METHOD_LONG,
+		&&TARGET_OP_CLASS_METHOD,
+		&&TARGET_OP_CLASS_METHOD_LONG,
+		&&TARGET_OP_INHERIT,
+		&&TARGET_OP_GET_SUPER,
+		&&TARGET_OP_GET_SUPER_LONG,
+		&&TARGET_OP_SUPER_INVOKE,
+		&&TARGET_OP_SUPER_INVOKE_LONG,
+		&&TARGET_OP_ADD_II,
+		&&TARGET_OP_ADD_FF,
+		&&TARGET_OP_ADD_SS,
+		&&TARGET_OP_SUBTRACT_II,
+		&&TARGET_OP_SUBTRACT_FF,
+		&&TARGET_OP_MULTIPLY_II,
+		&&TARGET_OP_MULTIPLY_FF,
+		&&TARGET_OP_GREATER_II,
+		&&TARGET_OP_GREATER_FF,
+		&&TARGET_OP_LESS_II,
+		&&TARGET_OP_LESS_FF,
+		&&TARGET_OP_ADD_LOCALS,
+		&&TARGET_OP_INC_LOCAL,
+		&&TARGET_OP_LT_LOCAL_CONST_JUMP,
+		&&TARGET_OP_LESS_EQUAL,
+		&&TARGET_OP_GREATER_EQUAL,
+		&&TARGET_OP_GET_LOCAL_PROPERTY,
+		&&TARGET_OP_MOVE,
+		&&TARGET_OP_LOAD_CONSTANT,
+		&&TARGET_OP_ADD_RRR,
+		&&TARGET_OP_SUBTRACT_RRR,
+		&&TARGET_OP_MULTIPLY_RRR,
+		&&TARGET_OP_DIVIDE_RRR,
+		&&TARGET_OP_ADD_RRK,
+		&&TARGET_OP_SUBTRACT_RRK,
+		&&TARGET_OP_MULTIPLY_RRK,
+		&&TARGET_OP_DIVIDE_RRK,
+		&&TARGET_OP_LESS_JUMP_RR,
+		&&TARGET_OP_SET_PROPERTY_RR,
+		&&TARGET_OP_TAIL_CALL,
+		&&TARGET_OP_RETURN,
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_RETURN + 1, "Dispatch table is out of sync with OpCode.");
+	// Every handler jumps straight to the next one, the switch is only used to enter the first instruction.
+	// A computed goto does not run destructors, so handlers must not keep non-trivial locals alive across DISPATCH().
+#define VM_CASE(op) case op: TARGET_##op
+#define DISPATCH() \
+	do \
+	{ \
+		TRACE_INSTRUCTION(); \
+		opCode = *ip++; \
+		goto *dispatchTable[opCode]; \
+	} while (0)
+#else
+#define VM_CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+	LOAD_FRAME();
+
 	auto READ_BYTE = [&]() -> uint8_t {
-		uint8_t byte = *IP++;
+		uint8_t byte = *ip++;
 		return byte;
 	};
 
 	auto READ_SHORT = [&]() -> uint16_t {
-		uint16_t value = (*IP << 8) | *(IP + 1);
-		IP += 2;
+		uint16_t value = (*ip << 8) | *(ip + 1);
+		ip += 2;
 		return value;
 	};
 
 	auto READ_THREE_BYTE = [&]() -> uint32_t {
-		uint32_t value = (*IP << 16) | (*(IP + 1) << 8) | *(IP + 2);
-		IP += 3;
+		uint32_t value = (*ip << 16) | (*(ip + 1) << 8) | *(ip + 2);
+		ip += 3;
 		return value;
 	};
 
 	auto READ_CONSTANT = [&]() -> VMValue
 	{
 		uint8_t constantIndex = READ_BYTE();
-		return frames[frameCount - 1].GetChunk()->constants.values[constantIndex];
+		return constants[constantIndex];
 	};
 
 	auto READ_LONG_CONSTANT = [&]() -> VMValue
 	{
 		uint32_t constantIndex = (READ_BYTE() << 16) | (READ_BYTE() << 8) | READ_BYTE();
-		return frames[frameCount - 1].GetChunk()->constants.values[constantIndex];
+		return constants[constantIndex];
 	};
 
 	auto READ_LOCAL_SLOT = [&]() -> uint32_t {
@@ -577,400 +1028,682 @@ InterpretResult VM::Run()
 	};
 
 	auto BINARY_OP = [&](OpCode op) {
-		VMValue b = Pop();
-		VMValue a = Pop();
+		VMValue b = POP();
+		VMValue a = POP();
 
 		if (!(IsNumber(a) && IsNumber(b)))
 		{
-			RuntimeError(IP, "Operands must be numbers!");
+			RuntimeError(ip, "Operands must be numbers!");
 			return INTERPRET_RUNTIME_ERROR;
 		}
 
-		bool bothIntegers = a.type == TYPE_INT && b.type == TYPE_INT;
-		float aNumber = a.type == TYPE_INT ? (float)a.integer : a.number;
-		float bNumber = b.type == TYPE_INT ? (float)b.integer : b.number;
+		bool bothIntegers = a.IsInt() && b.IsInt();
+		float aNumber = a.AsNumber();
+		float bNumber = b.AsNumber();
 		switch (op)
 		{
 			case OP_SUBTRACT:
-				Push(bothIntegers ? VMValue(a.integer - b.integer) : VMValue(aNumber - bNumber));
+				PUSH(bothIntegers ? VMValue(a.AsInt() - b.AsInt()) : VMValue(aNumber - bNumber));
 				break;
 			case OP_MULTIPLY:
-				Push(bothIntegers ? VMValue(a.integer * b.integer) : VMValue(aNumber * bNumber));
+				PUSH(bothIntegers ? VMValue(a.AsInt() * b.AsInt()) : VMValue(aNumber * bNumber));
 				break;
 			case OP_DIVIDE:
 			{
 				if (bNumber == 0.0f)
 				{
-					RuntimeError(IP, "Division by zero.");
+					RuntimeError(ip, "Division by zero.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Push(bothIntegers ? VMValue(a.integer / b.integer) : VMValue(aNumber / bNumber));
+				PUSH(bothIntegers ? VMValue(a.AsInt() / b.AsInt()) : VMValue(aNumber / bNumber));
 				break;
 			}
 			case OP_GREATER:
-				Push(VMValue(aNumber > bNumber));
+				PUSH(VMValue(aNumber > bNumber));
 				break;
 			case OP_LESS:
-				Push(VMValue(aNumber < bNumber));
+				PUSH(VMValue(aNumber < bNumber));
 				break;
 			default:
-				RuntimeError(IP, "Unknown binary operation!\n");
+				RuntimeError(ip, "Unknown binary operation!\n");
 				return INTERPRET_RUNTIME_ERROR;
 		}
 
 		return INTERPRET_OK;
 	};
 
+	auto CONCATENATE_OP = [&](VMValue a, VMValue b) {
+		VMValue string = VM::CreateString(static_cast<VMStringValue*>(a.AsObject())->value +
+			static_cast<VMStringValue*>(b.AsObject())->value);
+		if (!string.AsObject())
+		{
+			HeapLimitError(ip);
+			return INTERPRET_RUNTIME_ERROR;
+		}
+		PUSH(string);
+		return INTERPRET_OK;
+	};
+
 	auto ADD_OP = [&]() {
-		VMValue b = Pop();
-		VMValue a = Pop();
+		VMValue b = POP();
+		VMValue a = POP();
 		if (IsString(a) && IsString(b))
 		{
-			std::string result = static_cast<StringValue*>(a.object)->value +
-				static_cast<StringValue*>(b.object)->value;
-			Push(VM::Create(StringValue::CreateRaw(result)));
+			return CONCATENATE_OP(a, b);
 		}
 		else if (IsNumber(a) && IsNumber(b))
 		{
-			if (a.type == TYPE_INT && b.type == TYPE_INT)
+			if (a.IsInt() && b.IsInt())
 			{
-				Push(VMValue(a.integer + b.integer));
+				PUSH(VMValue(a.AsInt() + b.AsInt()));
 			}
 			else
 			{
-				float aNumber = a.type == TYPE_INT ? (float)a.integer : a.number;
-				float bNumber = b.type == TYPE_INT ? (float)b.integer : b.number;
-				Push(VMValue(aNumber + bNumber));
+				float aNumber = a.AsNumber();
+				float bNumber = b.AsNumber();
+				PUSH(VMValue(aNumber + bNumber));
 			}
 		}
 		else
 		{
-			RuntimeError(IP, "Operands must be two numbers or two strings for '+'.");
+			RuntimeError(ip, "Operands must be two numbers or two strings for '+'.");
 			return INTERPRET_RUNTIME_ERROR;
 		}
 		return INTERPRET_OK;
 	};
 
-	auto NOT_OP = [&]() {
-		VMValue value = Pop();
-		Push(VMValue(IsFalsey(value)));
+	// Three-address arithmetic, the result goes straight into a frame slot.
+	auto REGISTER_BINARY_OP = [&](uint8_t op, uint32_t dst, VMValue a, VMValue b) {
+		if (a.IsInt() && b.IsInt() && op != OP_DIVIDE)
+		{
+			int aInteger = a.AsInt();
+			int bInteger = b.AsInt();
+			slots[dst] = VMValue(op == OP_ADD ? aInteger + bInteger : op == OP_SUBTRACT ? aInteger - bInteger : aInteger * bInteger);
+			return INTERPRET_OK;
+		}
+		PUSH(a);
+		PUSH(b);
+		InterpretResult result = op == OP_ADD ? ADD_OP() : BINARY_OP((OpCode)op);
+		if (result != INTERPRET_OK)
+		{
+			return result;
+		}
+		slots[dst] = POP();
 		return INTERPRET_OK;
 	};
 
-	while (frames[frameCount - 1].GetChunk()->code)
-	{
-		if (IP >= frames[frameCount - 1].GetChunk()->code + frames[frameCount - 1].GetChunk()->count)
-		{
-			break;
-		}
-
-#ifdef DEBUG_TRACE_EXECUTION
-			printf("> ");
-			frames[frameCount - 1].GetChunk()->DisassembleInstruction((uint32_t)(IP - frames[frameCount - 1].GetChunk()->code), frameCount - 1);
-#endif
+	auto NOT_OP = [&]() {
+		VMValue value = POP();
+		PUSH(VMValue(IsFalsey(value)));
+		return INTERPRET_OK;
+	};
 
-		uint8_t opCode = READ_BYTE();
+	// Every chunk ends with OP_RETURN, so the loop only leaves through a return or an error.
+	for (;;)
+	{
+		TRACE_INSTRUCTION();
+		opCode = READ_BYTE();
 		switch (opCode)
 		{
-			case OP_CONSTANT:
-			case OP_CONSTANT_LONG:
+			VM_CASE(OP_CONSTANT):
+			VM_CASE(OP_CONSTANT_LONG):
 			{
 				VMValue value;
 				if (opCode == OP_CONSTANT)
 					value = READ_CONSTANT();
 				else
 					value = READ_LONG_CONSTANT();
-				Push(value);
-				break;
+				PUSH(value);
+				DISPATCH();
 			}
-			case OP_NIL:
+			VM_CASE(OP_NIL):
 			{
-				Push(VMValue::Nil());
-				break;
+				PUSH(VMValue::Nil());
+				DISPATCH();
 			}
-			case OP_TRUE:
+			VM_CASE(OP_TRUE):
 			{
-				Push(VMValue(true));
-				break;
+				PUSH(VMValue(true));
+				DISPATCH();
 			}
-			case OP_FALSE:
+			VM_CASE(OP_FALSE):
 			{
-				Push(VMValue(false));
-				break;
+				PUSH(VMValue(false));
+				DISPATCH();
 			}
-			case OP_NEGATE:
+			VM_CASE(OP_NEGATE):
 			{
-				InterpretResult result = Negate(IP);
+				InterpretResult result = Negate(ip);
 				if (result != INTERPRET_OK)
 				{
 					return result;
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_ADD:
+			VM_CASE(OP_ADD):
 			{
+				// Rewrite the site into its specialized form, it falls back here once the guard fails.
+				ip[-1] = QuickenBinaryOp(OP_ADD, stackTop[-2], stackTop[-1]);
 				InterpretResult result = ADD_OP();
 				if (result != INTERPRET_OK)
 				{
 					return result;
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_SUBTRACT:
-			case OP_MULTIPLY:
-			case OP_DIVIDE:
-			case OP_GREATER:
-			case OP_LESS:
+			VM_CASE(OP_SUBTRACT):
+			VM_CASE(OP_MULTIPLY):
+			VM_CASE(OP_DIVIDE):
+			VM_CASE(OP_GREATER):
+			VM_CASE(OP_LESS):
 			{
+				ip[-1] = QuickenBinaryOp(opCode, stackTop[-2], stackTop[-1]);
 				InterpretResult result = BINARY_OP((OpCode)opCode);
 				if (result != INTERPRET_OK)
 				{
 					return result;
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_NOT:
+			// Quickened opcodes only guard the operand types, a failed guard restores the generic opcode and re-executes it.
+#define QUICK_BINARY_OP(guard, result, genericOp) \
+			{ \
+				VMValue b = stackTop[-1]; \
+				VMValue a = stackTop[-2]; \
+				if (!(guard)) \
+				{ \
+					*--ip = genericOp; \
+					DISPATCH(); \
+				} \
+				stackTop[-2] = result; \
+				--stackTop; \
+				DISPATCH(); \
+			}
+			VM_CASE(OP_ADD_II):
+				QUICK_BINARY_OP(a.IsInt() && b.IsInt(), VMValue(a.AsInt() + b.AsInt()), OP_ADD)
+			VM_CASE(OP_ADD_FF):
+				QUICK_BINARY_OP(a.IsFloat() && b.IsFloat(), VMValue(a.AsFloat() + b.AsFloat()), OP_ADD)
+			VM_CASE(OP_SUBTRACT_II):
+				QUICK_BINARY_OP(a.IsInt() && b.IsInt(), VMValue(a.AsInt() - b.AsInt()), OP_SUBTRACT)
+			VM_CASE(OP_SUBTRACT_FF):
+				QUICK_BINARY_OP(a.IsFloat() && b.IsFloat(), VMValue(a.AsFloat() - b.AsFloat()), OP_SUBTRACT)
+			VM_CASE(OP_MULTIPLY_II):
+				QUICK_BINARY_OP(a.IsInt() && b.IsInt(), VMValue(a.AsInt() * b.AsInt()), OP_MULTIPLY)
+			VM_CASE(OP_MULTIPLY_FF):
+				QUICK_BINARY_OP(a.IsFloat() && b.IsFloat(), VMValue(a.AsFloat() * b.AsFloat()), OP_MULTIPLY)
+			VM_CASE(OP_GREATER_II):
+				QUICK_BINARY_OP(a.IsInt() && b.IsInt(), VMValue((float)a.AsInt() > (float)b.AsInt()), OP_GREATER)
+			VM_CASE(OP_GREATER_FF):
+				QUICK_BINARY_OP(a.IsFloat() && b.IsFloat(), VMValue(a.AsFloat() > b.AsFloat()), OP_GREATER)
+			VM_CASE(OP_LESS_II):
+				QUICK_BINARY_OP(a.IsInt() && b.IsInt(), VMValue((float)a.AsInt() < (float)b.AsInt()), OP_LESS)
+			VM_CASE(OP_LESS_FF):
+				QUICK_BINARY_OP(a.IsFloat() && b.IsFloat(), VMValue(a.AsFloat() < b.AsFloat()), OP_LESS)
+#undef QUICK_BINARY_OP
+			VM_CASE(OP_ADD_SS):
 			{
-				InterpretResult result = NOT_OP();
+				VMValue b = stackTop[-1];
+				VMValue a = stackTop[-2];
+				if (!IsString(a) || !IsString(b))
+				{
+					*--ip = OP_ADD;
+					DISPATCH();
+				}
+				stackTop -= 2;
+				if (CONCATENATE_OP(a, b) != INTERPRET_OK)
+				{
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				DISPATCH();
+			}
+			// Superinstructions fused by the compiler's peephole pass. Integer operands take a fast path,
+			// anything else is pushed and handed to the generic handlers so errors and results stay the same.
+			VM_CASE(OP_ADD_LOCALS):
+			{
+				VMValue a = slots[READ_LOCAL_SLOT()];
+				VMValue b = slots[READ_LOCAL_SLOT()];
+				if (a.IsInt() && b.IsInt())
+				{
+					PUSH(VMValue(a.AsInt() + b.AsInt()));
+					DISPATCH();
+				}
+				PUSH(a);
+				PUSH(b);
+				InterpretResult result = ADD_OP();
 				if (result != INTERPRET_OK)
 				{
 					return result;
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_EQUAL:
+			VM_CASE(OP_INC_LOCAL):
 			{
-				VMValue b = Pop();
-				VMValue a = Pop();
-				Push(VMValue(IsEqual(a, b)));
-				break;
+				uint32_t slot = READ_LOCAL_SLOT();
+				VMValue b = READ_CONSTANT();
+				VMValue a = slots[slot];
+				if (a.IsInt() && b.IsInt())
+				{
+					slots[slot] = VMValue(a.AsInt() + b.AsInt());
+					DISPATCH();
+				}
+				PUSH(a);
+				PUSH(b);
+				InterpretResult result = ADD_OP();
+				if (result != INTERPRET_OK)
+				{
+					return result;
+				}
+				slots[slot] = POP();
+				DISPATCH();
 			}
-			case OP_PRINT:
+			VM_CASE(OP_LT_LOCAL_CONST_JUMP):
 			{
-				VMValue value = Pop();
-				frames[frameCount - 1].GetChunk()->PrintValueStdout(value);
-				std::cout << std::endl;
-				break;
+				VMValue a = slots[READ_LOCAL_SLOT()];
+				VMValue b = READ_CONSTANT();
+				uint16_t offset = READ_SHORT();
+				bool less;
+				if (a.IsInt() && b.IsInt())
+				{
+					less = (float)a.AsInt() < (float)b.AsInt();
+				}
+				else
+				{
+					PUSH(a);
+					PUSH(b);
+					InterpretResult result = BINARY_OP(OP_LESS);
+					if (result != INTERPRET_OK)
+					{
+						return result;
+					}
+					less = POP().AsBool();
+				}
+				// The fused OP_POP only belongs to the fall-through path, the jump target still pops the condition.
+				if (!less)
+				{
+					PUSH(VMValue(false));
+					ip += offset;
+				}
+				DISPATCH();
 			}
-			case OP_POP:
+			VM_CASE(OP_LESS_EQUAL):
+			VM_CASE(OP_GREATER_EQUAL):
 			{
-				Pop();
-				break;
+				// Same as the negated comparison the compiler emitted, so NaN operands still compare true.
+				VMValue b = stackTop[-1];
+				VMValue a = stackTop[-2];
+				if (a.IsInt() && b.IsInt())
+				{
+					float aNumber = (float)a.AsInt();
+					float bNumber = (float)b.AsInt();
+					stackTop[-2] = VMValue(opCode == OP_LESS_EQUAL ? !(aNumber > bNumber) : !(aNumber < bNumber));
+					--stackTop;
+					DISPATCH();
+				}
+				InterpretResult result = BINARY_OP(opCode == OP_LESS_EQUAL ? OP_GREATER : OP_LESS);
+				if (result != INTERPRET_OK)
+				{
+					return result;
+				}
+				stackTop[-1] = VMValue(!stackTop[-1].AsBool());
+				DISPATCH();
 			}
-			case OP_DUP:
+			VM_CASE(OP_MOVE):
 			{
-				Push(Peek(0));
-				break;
+				uint32_t dst = READ_LOCAL_SLOT();
+				slots[dst] = slots[READ_LOCAL_SLOT()];
+				DISPATCH();
 			}
-			case OP_NOP:
+			VM_CASE(OP_LOAD_CONSTANT):
 			{
-				break;
+				uint32_t dst = READ_LOCAL_SLOT();
+				slots[dst] = READ_CONSTANT();
+				DISPATCH();
 			}
-			case OP_DEFINE_GLOBAL:
-			case OP_DEFINE_GLOBAL_LONG:
+			VM_CASE(OP_ADD_RRR):
+			VM_CASE(OP_SUBTRACT_RRR):
+			VM_CASE(OP_MULTIPLY_RRR):
+			VM_CASE(OP_DIVIDE_RRR):
 			{
-				VMValue nameValue;
-				if (opCode == OP_DEFINE_GLOBAL)
-					nameValue = READ_CONSTANT();
-				else
-					nameValue = READ_LONG_CONSTANT();
-
-				size_t slot;
-				if (!ResolveOrCreateGlobalSlot(nameValue, slot, IP))
+				uint32_t dst = READ_LOCAL_SLOT();
+				VMValue a = slots[READ_LOCAL_SLOT()];
+				VMValue b = slots[READ_LOCAL_SLOT()];
+				InterpretResult result = REGISTER_BINARY_OP((uint8_t)(OP_ADD + (opCode - OP_ADD_RRR)), dst, a, b);
+				if (result != INTERPRET_OK)
 				{
-					return INTERPRET_RUNTIME_ERROR;
+					return result;
 				}
-
-				globalSlots[slot] = Pop();
-				break;
+				DISPATCH();
 			}
-			case OP_GET_GLOBAL:
-			case OP_GET_GLOBAL_LONG:
+			VM_CASE(OP_ADD_RRK):
+			VM_CASE(OP_SUBTRACT_RRK):
+			VM_CASE(OP_MULTIPLY_RRK):
+			VM_CASE(OP_DIVIDE_RRK):
 			{
-				VMValue nameValue;
-				if (opCode == OP_GET_GLOBAL)
-					nameValue = READ_CONSTANT();
-				else
-					nameValue = READ_LONG_CONSTANT();
-
-				size_t slot;
-				if (!ResolveExistingGlobalSlot(nameValue, slot, IP))
+				uint32_t dst = READ_LOCAL_SLOT();
+				VMValue a = slots[READ_LOCAL_SLOT()];
+				VMValue b = READ_CONSTANT();
+				InterpretResult result = REGISTER_BINARY_OP((uint8_t)(OP_ADD + (opCode - OP_ADD_RRK)), dst, a, b);
+				if (result != INTERPRET_OK)
 				{
-					return INTERPRET_RUNTIME_ERROR;
+					return result;
 				}
-
-				Push(globalSlots[slot]);
-				break;
+				DISPATCH();
 			}
-			case OP_SET_GLOBAL:
-			case OP_SET_GLOBAL_LONG:
+			VM_CASE(OP_LESS_JUMP_RR):
 			{
-				VMValue nameValue;
-				if (opCode == OP_SET_GLOBAL)
-					nameValue = READ_CONSTANT();
+				VMValue a = slots[READ_LOCAL_SLOT()];
+				VMValue b = slots[READ_LOCAL_SLOT()];
+				uint16_t offset = READ_SHORT();
+				bool less;
+				if (a.IsInt() && b.IsInt())
+				{
+					less = (float)a.AsInt() < (float)b.AsInt();
+				}
 				else
-					nameValue = READ_LONG_CONSTANT();
-
-				size_t slot;
-				if (!ResolveExistingGlobalSlot(nameValue, slot, IP))
 				{
+					PUSH(a);
+					PUSH(b);
+					InterpretResult result = BINARY_OP(OP_LESS);
+					if (result != INTERPRET_OK)
+					{
+						return result;
+					}
+					less = POP().AsBool();
+				}
+				if (!less)
+				{
+					PUSH(VMValue(false));
+					ip += offset;
+				}
+				DISPATCH();
+			}
+			VM_CASE(OP_SET_PROPERTY_RR):
+			{
+				VMValue object = slots[READ_LOCAL_SLOT()];
+				VMValue nameValue = READ_CONSTANT();
+				VMValue valueToSet = slots[READ_LOCAL_SLOT()];
+				uint8_t cacheIndex = READ_BYTE();
+				if (!nameValue.IsObjectType(TYPE_STRING))
+				{
+					RuntimeError(ip, "Property name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-
-				globalSlots[slot] = Peek(0);
-				break;
+				if (!object.IsObjectType(TYPE_INSTANCE))
+				{
+					RuntimeError(ip, "Only instances have properties.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				if (!StoreField(instance, static_cast<VMStringValue*>(nameValue.AsObject()), valueToSet, &chunk->GetInlineCache(cacheIndex)))
+				{
+					HeapLimitError(ip);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				DISPATCH();
 			}
-			case OP_GET_LOCAL:
-			case OP_GET_LOCAL_LONG:
+			VM_CASE(OP_NOT):
 			{
-				uint32_t slot = (opCode == OP_GET_LOCAL) ? READ_LOCAL_SLOT() : READ_LONG_LOCAL_SLOT();
-				// Local slots are addressed relative to the current frame's base slot.
-				if (frames[frameCount - 1].slots == nullptr || slot >= (uint32_t)(stackTop - frames[frameCount - 1].slots))
+				InterpretResult result = NOT_OP();
+				if (result != INTERPRET_OK)
+				{
+					return result;
+				}
+				DISPATCH();
+			}
+			VM_CASE(OP_EQUAL):
+			{
+				VMValue b = POP();
+				VMValue a = POP();
+				PUSH(VMValue(IsEqual(a, b)));
+				DISPATCH();
+			}
+			VM_CASE(OP_PRINT):
+			{
+				VMValue value = POP();
+				chunk->PrintValueStdout(value);
+				std::cout << std::endl;
+				DISPATCH();
+			}
+			VM_CASE(OP_POP):
+			{
+				DROP();
+				DISPATCH();
+			}
+			VM_CASE(OP_DUP):
+			{
+				PUSH(PEEK(0));
+				DISPATCH();
+			}
+			VM_CASE(OP_NOP):
+			{
+				DISPATCH();
+			}
+			VM_CASE(OP_DEFINE_GLOBAL):
+			VM_CASE(OP_DEFINE_GLOBAL_LONG):
+			{
+				uint32_t slot = (opCode == OP_DEFINE_GLOBAL) ? READ_BYTE() : READ_THREE_BYTE();
+				globalSlots[slot] = POP();
+				DISPATCH();
+			}
+			VM_CASE(OP_GET_GLOBAL):
+			VM_CASE(OP_GET_GLOBAL_LONG):
+			{
+				uint32_t slot = (opCode == OP_GET_GLOBAL) ? READ_BYTE() : READ_THREE_BYTE();
+				VMValue value = globalSlots[slot];
+				// The slot exists from compile time, it only holds a value once the definition ran.
+				if (!value.IsValid())
 				{
-					RuntimeError(IP, "Local slot %d out of range.", slot);
+					RuntimeError(ip, "Undefined global variable '%s'.", globalNames[slot].c_str());
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Push(frames[frameCount - 1].slots[slot]);
-				break;
+				PUSH(value);
+				DISPATCH();
 			}
-			case OP_SET_LOCAL:
-			case OP_SET_LOCAL_LONG:
+			VM_CASE(OP_SET_GLOBAL):
+			VM_CASE(OP_SET_GLOBAL_LONG):
 			{
-				uint32_t slot = (opCode == OP_SET_LOCAL) ? READ_LOCAL_SLOT() : READ_LONG_LOCAL_SLOT();
-				// Writing through the frame base updates the live local variable in place.
-				if (frames[frameCount - 1].slots == nullptr || slot >= (uint32_t)(stackTop - frames[frameCount - 1].slots))
+				uint32_t slot = (opCode == OP_SET_GLOBAL) ? READ_BYTE() : READ_THREE_BYTE();
+				if (!globalSlots[slot].IsValid())
 				{
-					RuntimeError(IP, "Local slot out of range.");
+					RuntimeError(ip, "Undefined global variable '%s'.", globalNames[slot].c_str());
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				frames[frameCount - 1].slots[slot] = Peek(0);
-				break;
+				globalSlots[slot] = PEEK(0);
+				DISPATCH();
+			}
+			VM_CASE(OP_GET_LOCAL):
+			VM_CASE(OP_GET_LOCAL_LONG):
+			{
+				uint32_t slot = (opCode == OP_GET_LOCAL) ? READ_LOCAL_SLOT() : READ_LONG_LOCAL_SLOT();
+				// Local slots are addressed relative to the current frame's base slot.
+				// The compiler only emits slots of declared locals, so they are always below stackTop.
+				assert(slot < (uint32_t)(stackTop - slots));
+				PUSH(slots[slot]);
+				DISPATCH();
+			}
+			VM_CASE(OP_SET_LOCAL):
+			VM_CASE(OP_SET_LOCAL_LONG):
+			{
+				uint32_t slot = (opCode == OP_SET_LOCAL) ? READ_LOCAL_SLOT() : READ_LONG_LOCAL_SLOT();
+				// Writing through the frame base updates the live local variable in place.
+				assert(slot < (uint32_t)(stackTop - slots));
+				slots[slot] = PEEK(0);
+				DISPATCH();
 			}
-			case OP_JUMP_IF_FALSE:
+			VM_CASE(OP_JUMP_IF_FALSE):
 			{
 				uint16_t offset = READ_SHORT();
-				if (IsFalsey(Peek(0)))
+				if (IsFalsey(PEEK(0)))
 				{
-					IP += offset;
+					ip += offset;
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_JUMP:
+			VM_CASE(OP_JUMP):
 			{
 				uint16_t offset = READ_SHORT();
-				IP += offset;
-				break;
+				ip += offset;
+				DISPATCH();
 			}
-			case OP_LOOP:
+			VM_CASE(OP_LOOP):
 			{
 				uint16_t offset = READ_SHORT();
-				IP -= offset;
-				break;
+				ip -= offset;
+				DISPATCH();
 			}
-			case OP_CALL:
+			VM_CASE(OP_CALL):
 			{
 				uint8_t argCount = READ_BYTE();
+				InlineCache& cache = chunk->GetInlineCache(READ_SHORT());
 				// The callee sits below its arguments on the stack.
-				VMValue callee = Peek(argCount);
+				VMValue callee = PEEK(argCount);
+				// A hit means the same closure was entered here before, so type and arity are already checked.
+				if (callee.IsObject() && callee.AsObject() == cache.callee && cache.calleeEpoch == closureEpoch && frameCount < frameCapacity && frameCount < maxFrames &&
+					(size_t)(stackTop - stacks) + (size_t)cache.calleeStackSize <= stackCapacity)
+				{
+					SAVE_IP();
+					frame = &frames[frameCount++];
+					frame->closure = callee;
+					frame->slots = stackTop - argCount - 1;
+					frame->inner = VMValue();
+					chunk = cache.calleeChunk;
+					constants = chunk->constants.values;
+					slots = frame->slots;
+					ip = chunk->code;
+					frame->ip = ip;
+					DISPATCH();
+				}
 				// Update the instruction pointer before calling so the callee can return to the correct place.
-				frames[frameCount - 1].ip = IP;
-				if (!Call(callee, argCount, IP))
+				SAVE_IP();
+				uint32_t callerFrameCount = frameCount;
+				if (!Call(callee, argCount, ip))
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				IP = frames[frameCount - 1].ip;
-				break;
+				LOAD_FRAME();
+				// Only plain closures are cached, bound methods and classes also rewrite the callee slot.
+				if (frameCount > callerFrameCount && callee.IsObjectType(TYPE_CALLABLE))
+				{
+					static_cast<Compiler::VMClosureValue*>(callee.AsObject())->isCallCached = true;
+					cache.callee = callee.AsObject();
+					cache.calleeEpoch = closureEpoch;
+					cache.calleeChunk = chunk;
+					cache.calleeStackSize = static_cast<Compiler::VMFunctionBase*>(static_cast<Compiler::VMClosureValue*>(callee.AsObject())->function.AsObject())->maxStackSize;
+				}
+				DISPATCH();
+			}
+			VM_CASE(OP_TAIL_CALL):
+			{
+				uint8_t argCount = READ_BYTE();
+				// The frame is reused, so the call cache slot is not needed here.
+				READ_SHORT();
+				VMValue callee = PEEK(argCount);
+				SAVE_IP();
+				if (!TailCall(callee, argCount, ip))
+				{
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				LOAD_FRAME();
+				DISPATCH();
 			}
-			case OP_ROOT_INVOKE:
-			case OP_ROOT_INVOKE_LONG:
+			VM_CASE(OP_ROOT_INVOKE):
+			VM_CASE(OP_ROOT_INVOKE_LONG):
 			{
 				VMValue nameValue = (opCode == OP_ROOT_INVOKE) ? READ_CONSTANT() : READ_LONG_CONSTANT();
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Method name must be a string.");
+					RuntimeError(ip, "Method name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				uint8_t argCountValue = READ_BYTE();
 				VMValue receiver = stackTop[-argCountValue - 1];
-				if (receiver.type != TYPE_INSTANCE || receiver.object == nullptr)
+				if (!receiver.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have methods.");
+					RuntimeError(ip, "Only instances have methods.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				const std::string& methodName = static_cast<StringValue*>(nameValue.object)->value;
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(receiver.object);
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.object);
-				std::vector<VMValue> methods;
-				Compiler::VMClassValue* current = klass;
-				while (current)
+				VMStringValue* methodName = static_cast<VMStringValue*>(nameValue.AsObject());
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(receiver.AsObject());
+				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.AsObject());
+				VMValue rootMethod;
+				VMValue nextInner;
 				{
-					VMValue method = current->FindDirectMethod(methodName);
-					if (method.object)
+					std::vector<VMValue> methods;
+					Compiler::VMClassValue* current = klass;
+					while (current)
 					{
-						methods.push_back(method);
+						VMValue method = current->FindDirectMethod(methodName);
+						if (method.AsObject())
+						{
+							methods.push_back(method);
+						}
+						current = current->superClass.AsObject() ? static_cast<Compiler::VMClassValue*>(current->superClass.AsObject()) : nullptr;
 					}
-					current = current->superClass.object ? static_cast<Compiler::VMClassValue*>(current->superClass.object) : nullptr;
-				}
 
-				if (methods.empty())
-				{
-					RuntimeError(IP, "Undefined method '%s'.", methodName.c_str());
-					return INTERPRET_RUNTIME_ERROR;
-				}
+					if (methods.empty())
+					{
+						RuntimeError(ip, "Undefined method '%s'.", methodName->value.c_str());
+						return INTERPRET_RUNTIME_ERROR;
+					}
 
-				// methods is derived-to-base. Build the inner chain in the
-				// opposite direction so the base method sees the next derived method.
-				VMValue nextInner;
-				for (size_t i = 0; i + 1 < methods.size(); ++i)
-				{
-					nextInner = VM::Create(new InnerValue(methods[i], nextInner));
-					Push(nextInner);
+					// methods is derived-to-base. Build the inner chain in the
+					// opposite direction so the base method sees the next derived method.
+					for (size_t i = 0; i + 1 < methods.size(); ++i)
+					{
+						nextInner = VM::Create(new InnerValue(methods[i], nextInner));
+						if (!nextInner.AsObject())
+						{
+							HeapLimitError(ip);
+							return INTERPRET_RUNTIME_ERROR;
+						}
+						// The chain length depends on the class hierarchy, so this push stays checked.
+						Push(nextInner);
+					}
+					stackTop -= (int32_t)(methods.size() - 1);
+					rootMethod = methods.back();
 				}
-				stackTop -= (int32_t)(methods.size() - 1);
 
-				frames[frameCount - 1].ip = IP;
-				if (!Invoke(receiver, methods.back(), argCountValue, IP))
+				SAVE_IP();
+				if (!Invoke(receiver, rootMethod, argCountValue, ip))
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				frames[frameCount - 1].inner = nextInner;
-				IP = frames[frameCount - 1].ip;
-				break;
+				LOAD_FRAME();
+				frame->inner = nextInner;
+				DISPATCH();
 			}
-			case OP_INNER_INVOKE:
+			VM_CASE(OP_INNER_INVOKE):
 			{
 				uint8_t argCountValue = READ_BYTE();
-				CallFrame* caller = &frames[frameCount - 1];
-				VMValue inner = caller->inner;
+				VMValue inner = frame->inner;
 				if (!inner.IsValid())
 				{
-					RuntimeError(IP, "inner() can only be used during a root invocation.");
+					RuntimeError(ip, "inner() can only be used during a root invocation.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				if (inner.type != TYPE_INNER_VALUE || inner.object == nullptr)
+				if (!inner.IsObjectType(TYPE_INNER_VALUE))
 				{
-					RuntimeError(IP, "Inner value expected for invocation.");
+					RuntimeError(ip, "Inner value expected for invocation.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				VMValue instance = stackTop[-argCountValue - 1];
-				InnerValue* innerValue = static_cast<InnerValue*>(inner.object);
-				caller->ip = IP;
-				if (!Invoke(instance, innerValue->closure, argCountValue, IP))
+				InnerValue* innerValue = static_cast<InnerValue*>(inner.AsObject());
+				SAVE_IP();
+				if (!Invoke(instance, innerValue->closure, argCountValue, ip))
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				frames[frameCount - 1].inner = innerValue->nextInner;
-				IP = frames[frameCount - 1].ip;
-				break;
+				LOAD_FRAME();
+				frame->inner = innerValue->nextInner;
+				DISPATCH();
 			}
-			case OP_RETURN:
+			VM_CASE(OP_RETURN):
 			{
-				CallFrame* frame = &frames[frameCount - 1];
-				VMValue returnValue = Pop();
+				VMValue returnValue = POP();
 				// Close all open upvalues owned by this frame before unwinding.
-				CloseUpvalues(frame->slots);
+				CloseUpvalues(slots);
 				if (frameCount == 1)
 				{
 					ResetStack();
@@ -978,107 +1711,124 @@ InterpretResult VM::Run()
 					return INTERPRET_OK;
 				}
 				// Restore the stack to the callee slot so the caller's locals stay intact.
-				stackTop = frame->slots;
+				stackTop = slots;
 				*stackTop++ = returnValue;
 				--frameCount;
-				// Update the instruction pointer to the caller frame's IP so execution continues from there.
-				IP = frames[frameCount - 1].ip;
-				break;
+				// Resume the caller frame from the ip it saved before the call.
+				LOAD_FRAME();
+				DISPATCH();
 			}
-			case OP_CLOSURE:
+			VM_CASE(OP_CLOSURE):
 			{
-				VMValue functionValue = Pop();
-				if (functionValue.type != TYPE_CALLABLE || functionValue.object == nullptr)
+				VMValue functionValue = POP();
+				if (!functionValue.IsObjectType(TYPE_CALLABLE))
 				{
-					RuntimeError(IP, "Can only create closures from function values.");
+					RuntimeError(ip, "Can only create closures from function values.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				std::vector<VMValue> upvalues;
-				uint8_t upvalueCount = READ_BYTE();
-				for (int32_t i = 0; i < upvalueCount; ++i)
+				// The upvalue vector lives in its own block so it is destroyed before DISPATCH jumps away.
+				VMValue closure;
 				{
-					uint8_t isLocal = READ_BYTE();
-					uint32_t index = (uint32_t)READ_BYTE();
-					if (isLocal)
+					std::vector<VMValue> upvalues;
+					uint8_t upvalueCount = READ_BYTE();
+					for (int32_t i = 0; i < upvalueCount; ++i)
 					{
-						if (frames[frameCount - 1].slots == nullptr || index >= (uint32_t)(stackTop - frames[frameCount - 1].slots))
+						uint8_t isLocal = READ_BYTE();
+						uint32_t index = (uint32_t)READ_BYTE();
+						if (isLocal)
 						{
-							RuntimeError(IP, "Local slot index out of range for closure.");
-							return INTERPRET_RUNTIME_ERROR;
+							if (slots == nullptr || index >= (uint32_t)(stackTop - slots))
+							{
+								RuntimeError(ip, "Local slot index out of range for closure.");
+								return INTERPRET_RUNTIME_ERROR;
+							}
+							// Capture the local variable by creating an upvalue that points to the variable's slot on the stack.
+							// This is a open upvalue that will be closed when the variable goes out of scope.
+							VMValue capturedValue = CaptureUpvalue(&slots[index]);
+							if (!capturedValue.AsObject())
+							{
+								HeapLimitError(ip);
+								return INTERPRET_RUNTIME_ERROR;
+							}
+							upvalues.push_back(capturedValue);
 						}
-						// Capture the local variable by creating an upvalue that points to the variable's slot on the stack.
-						// This is a open upvalue that will be closed when the variable goes out of scope.
-						VMValue capturedValue = CaptureUpvalue(&frames[frameCount - 1].slots[index]);
-						upvalues.push_back(capturedValue);
-					}
-					else
-					{
-						if (index >= frames[frameCount - 1].GetUpvalues().size())
+						else
 						{
-							RuntimeError(IP, "Upvalue index out of range for closure.");
-							return INTERPRET_RUNTIME_ERROR;
+							if (index >= frame->GetUpvalues().size())
+							{
+								RuntimeError(ip, "Upvalue index out of range for closure.");
+								return INTERPRET_RUNTIME_ERROR;
+							}
+							upvalues.push_back(frame->GetUpvalues()[index]);
 						}
-						upvalues.push_back(frames[frameCount - 1].GetUpvalues()[index]);
+					}
+					closure = VM::Create(new Compiler::VMClosureValue(functionValue, std::move(upvalues)));
+					if (!closure.AsObject())
+					{
+						HeapLimitError(ip);
+						return INTERPRET_RUNTIME_ERROR;
 					}
 				}
-				VMValue closure = VM::Create(new Compiler::VMClosureValue(functionValue, upvalues));
-				Push(closure);
-				break;
+				PUSH(closure);
+				DISPATCH();
 			}
-			case OP_GET_UPVALUE:
+			VM_CASE(OP_GET_UPVALUE):
 			{
 				uint8_t index = READ_BYTE();
-				CallFrame* frame = &frames[frameCount - 1];
 				if (index >= frame->GetUpvalues().size())
 				{
-					RuntimeError(IP, "Upvalue index out of range.");
+					RuntimeError(ip, "Upvalue index out of range.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				VMValue value = frame->GetUpvalues()[index];
-				UpvalueValue* upvalue = static_cast<UpvalueValue*>(value.object);
-				Push(*upvalue->location);
-				break;
+				UpvalueValue* upvalue = static_cast<UpvalueValue*>(value.AsObject());
+				PUSH(*upvalue->location);
+				DISPATCH();
 			}
-			case OP_SET_UPVALUE:
+			VM_CASE(OP_SET_UPVALUE):
 			{
 				uint8_t index = READ_BYTE();
-				CallFrame* frame = &frames[frameCount - 1];
 				if (index >= frame->GetUpvalues().size())
 				{
-					RuntimeError(IP, "Upvalue index out of range.");
+					RuntimeError(ip, "Upvalue index out of range.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue newValue = Peek(0);
-				UpvalueValue* upvalue = static_cast<UpvalueValue*>(frame->GetUpvalues()[index].object);
+				VMValue newValue = PEEK(0);
+				UpvalueValue* upvalue = static_cast<UpvalueValue*>(frame->GetUpvalues()[index].AsObject());
 				*upvalue->location = newValue;
-				break;
+				WriteBarrier(upvalue, newValue);
+				DISPATCH();
 			}
-			case OP_CLOSE_UPVALUE:
+			VM_CASE(OP_CLOSE_UPVALUE):
 			{
-				CallFrame* frame = &frames[frameCount - 1];
 				CloseUpvalues(stackTop - 1);
-				Pop();
-				break;
+				DROP();
+				DISPATCH();
 			}
-			case OP_CLASS:
+			VM_CASE(OP_CLASS):
 			{
 				VMValue nameValue = READ_CONSTANT();
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Class name must be a string.");
+					RuntimeError(ip, "Class name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue classValue = VM::Create(new Compiler::VMClassValue(static_cast<StringValue*>(nameValue.object)->value));
-				Push(classValue);
-				break;
+				VMValue classValue = VM::Create(new Compiler::VMClassValue(static_cast<VMStringValue*>(nameValue.AsObject())->value));
+				if (!classValue.AsObject())
+				{
+					HeapLimitError(ip);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				PUSH(classValue);
+				DISPATCH();
 			}
-			case OP_INVOKE:
-			case OP_INVOKE_LONG:
+			VM_CASE(OP_INVOKE):
+			VM_CASE(OP_INVOKE_LONG):
 			{
 				VMValue nameValue = (opCode == OP_INVOKE) ? READ_CONSTANT() : READ_LONG_CONSTANT();
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Method name must be a string.");
+					RuntimeError(ip, "Method name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
@@ -1086,40 +1836,47 @@ InterpretResult VM::Run()
 				uint32_t cacheIndex = (opCode == OP_INVOKE) ? READ_BYTE() : READ_THREE_BYTE();
 
 				VMValue object = stackTop[-argCountValue - 1];
-				const std::string& propertyName = static_cast<StringValue*>(nameValue.object)->value;
-				if (object.type == TYPE_CLASS && object.object != nullptr)
+				VMStringValue* propertyName = static_cast<VMStringValue*>(nameValue.AsObject());
+				if (object.IsObjectType(TYPE_CLASS))
 				{
-					frames[frameCount - 1].ip = IP;
-					if (!InvokeClassMethod(object, propertyName, argCountValue, IP))
+					SAVE_IP();
+					if (!InvokeClassMethod(object, propertyName, argCountValue, ip))
 					{
 						return INTERPRET_RUNTIME_ERROR;
 					}
-					IP = frames[frameCount - 1].ip;
-					break;
+					LOAD_FRAME();
+					DISPATCH();
 				}
-				if (object.type != TYPE_INSTANCE || object.object == nullptr)
+				if (!object.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have methods.");
+					RuntimeError(ip, "Only instances have methods.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.object);
-				// Keep the caller IP up to date before either call path can push a frame.
-				frames[frameCount - 1].ip = IP;
-				if (!InvokeFromClass(instance->classValue, object, propertyName, argCountValue, cacheIndex, IP))
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				// Keep the caller ip up to date before either call path can push a frame.
+				SAVE_IP();
+				if (!InvokeFromClass(instance->classValue, object, propertyName, argCountValue, cacheIndex, ip))
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				IP = frames[frameCount - 1].ip;
-				break;
+				LOAD_FRAME();
+				DISPATCH();
 			}
-			case OP_GET_PROPERTY:
-			case OP_GET_PROPERTY_LONG:
+			VM_CASE(OP_GET_PROPERTY):
+			VM_CASE(OP_GET_PROPERTY_LONG):
+			VM_CASE(OP_GET_LOCAL_PROPERTY):
 			{
-				Chunk* chunk = frames[frameCount - 1].GetChunk();
 				uint32_t constantIndex;
 				uint32_t cacheIndex;
-				if (opCode == OP_GET_PROPERTY)
+				if (opCode == OP_GET_LOCAL_PROPERTY)
+				{
+					// Push the local first, the rest is the plain property access.
+					PUSH(slots[READ_LOCAL_SLOT()]);
+					constantIndex = READ_BYTE();
+					cacheIndex = READ_BYTE();
+				}
+				else if (opCode == OP_GET_PROPERTY)
 				{
 					constantIndex = READ_BYTE();
 					cacheIndex = READ_BYTE();
@@ -1130,41 +1887,41 @@ InterpretResult VM::Run()
 					cacheIndex = READ_THREE_BYTE();
 				}
 
-				VMValue object = Peek(0);
-				VMValue nameValue = chunk->constants.values[constantIndex];
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				VMValue object = PEEK(0);
+				VMValue nameValue = constants[constantIndex];
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Property name must be a string.");
+					RuntimeError(ip, "Property name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				const std::string& propertyName = static_cast<StringValue*>(nameValue.object)->value;
+				VMStringValue* propertyName = static_cast<VMStringValue*>(nameValue.AsObject());
 
-				if (object.type == TYPE_CLASS && object.object != nullptr)
+				if (object.IsObjectType(TYPE_CLASS))
 				{
-					Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(object.object);
+					Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(object.AsObject());
 					VMValue method = klass->FindClassMethod(propertyName);
-					if (!method.object)
+					if (!method.AsObject())
 					{
-						RuntimeError(IP, "Undefined class method '%s'.", propertyName.c_str());
+						RuntimeError(ip, "Undefined class method '%s'.", propertyName->value.c_str());
 						return INTERPRET_RUNTIME_ERROR;
 					}
-					Pop();
-					Push(method);
-					break;
+					DROP();
+					PUSH(method);
+					DISPATCH();
 				}
 
-				if (object.type != TYPE_INSTANCE || object.object == nullptr)
+				if (!object.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have properties.");
+					RuntimeError(ip, "Only instances have properties.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.object);
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.object);
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.AsObject());
 
 				InlineCache& cache = chunk->GetInlineCache(cacheIndex);
-				uint32_t slot = Compiler::VMClassValue::INVALID_SLOT;
+				uint32_t slot = Shape::INVALID_SLOT;
 				VMValue method;
-				const InlineCache::Entry* entry = cache.Match(klass, klass->slotNum);
+				const InlineCache::Entry* entry = cache.Match(instance->shape->id);
 				if (entry)
 				{
 					slot = entry->slot;
@@ -1172,50 +1929,54 @@ InterpretResult VM::Run()
 				}
 				else
 				{
-					slot = klass->GetSlot(propertyName);
+					slot = instance->shape->Find(propertyName);
 					method = klass->FindMethod(propertyName);
-					cache.Update(klass, klass->slotNum, slot, method);
+					cache.Update(instance->shape->id, slot, method);
 				}
 
-				VMValue valueToGet = (slot != Compiler::VMClassValue::INVALID_SLOT) ? instance->GetField(slot) : VMValue();
+				VMValue valueToGet = (slot != Shape::INVALID_SLOT) ? instance->GetField(slot) : VMValue();
 				if (valueToGet.IsValid())
 				{
 					// Pop the instance
-					Pop();
-					Push(valueToGet);
+					DROP();
+					PUSH(valueToGet);
 				}
 				else
 				{
-					if (method.object)
+					if (method.AsObject())
 					{
 						VMValue boundMethod = VM::Create(new Compiler::BoundMethodValue(object, method));
-						Pop();
-						Push(boundMethod);
+						if (!boundMethod.AsObject())
+						{
+							HeapLimitError(ip);
+							return INTERPRET_RUNTIME_ERROR;
+						}
+						DROP();
+						PUSH(boundMethod);
 
-						Compiler::VMFunctionBase* function = static_cast<Compiler::VMFunctionBase*>(method.object);
+						Compiler::VMFunctionBase* function = static_cast<Compiler::VMFunctionBase*>(method.AsObject());
 						if (function->IsGetter())
 						{
 							// Call it right away if this is a getter invocation
-							frames[frameCount - 1].ip = IP;
-							if (!Call(boundMethod, 0, IP))
+							SAVE_IP();
+							if (!Call(boundMethod, 0, ip))
 							{
 								return INTERPRET_RUNTIME_ERROR;
 							}
-							IP = frames[frameCount - 1].ip;
+							LOAD_FRAME();
 						}
 					}
 					else
 					{
-						RuntimeError(IP, "Undefined property '%s'.", propertyName.c_str());
+						RuntimeError(ip, "Undefined property '%s'.", propertyName->value.c_str());
 						return INTERPRET_RUNTIME_ERROR;
 					}
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_SET_PROPERTY:
-			case OP_SET_PROPERTY_LONG:
+			VM_CASE(OP_SET_PROPERTY):
+			VM_CASE(OP_SET_PROPERTY_LONG):
 			{
-				Chunk* chunk = frames[frameCount - 1].GetChunk();
 				uint32_t constantIndex;
 				uint32_t cacheIndex;
 				if (opCode == OP_SET_PROPERTY)
@@ -1229,98 +1990,96 @@ InterpretResult VM::Run()
 					cacheIndex = READ_THREE_BYTE();
 				}
 
-				VMValue nameValue = chunk->constants.values[constantIndex];
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				VMValue nameValue = constants[constantIndex];
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Property name must be a string.");
+					RuntimeError(ip, "Property name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue valueToSet = Pop();
-				VMValue object = Pop();
-				if (object.type != TYPE_INSTANCE || object.object == nullptr)
+				// Both stay on the stack while storing, growing the instance may collect.
+				VMValue valueToSet = PEEK(0);
+				VMValue object = PEEK(1);
+				if (!object.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have properties.");
+					RuntimeError(ip, "Only instances have properties.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.object);
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.object);
-				const std::string& propertyName = static_cast<StringValue*>(nameValue.object)->value;
-
-				InlineCache& cache = chunk->GetInlineCache(cacheIndex);
-				const InlineCache::Entry* entry = cache.Match(klass, klass->slotNum);
-				uint32_t slot;
-				if (entry)
-				{
-					slot = entry->slot;
-				}
-				else
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				VMStringValue* propertyName = static_cast<VMStringValue*>(nameValue.AsObject());
+				if (!StoreField(instance, propertyName, valueToSet, &chunk->GetInlineCache(cacheIndex)))
 				{
-					slot = klass->GetOrCreateSlot(propertyName);
-					cache.Update(klass, klass->slotNum, slot, VMValue());
+					HeapLimitError(ip);
+					return INTERPRET_RUNTIME_ERROR;
 				}
-				instance->SetField(slot, valueToSet);
-				Push(valueToSet);
-				break;
+				DROP();
+				DROP();
+				PUSH(valueToSet);
+				DISPATCH();
 			}
-			case OP_GET_INDEX:
+			VM_CASE(OP_GET_INDEX):
 			{
-				VMValue nameValue = Pop();
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				VMValue nameValue = POP();
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Property name must be a string.");
+					RuntimeError(ip, "Property name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue object = Pop();
-				if (object.type != TYPE_INSTANCE || object.object == nullptr)
+				VMValue object = POP();
+				if (!object.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances can be indexed.");
+					RuntimeError(ip, "Only instances can be indexed.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.object);
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.object);
-				const std::string& propertyName = static_cast<StringValue*>(nameValue.object)->value;
-				uint32_t slot = klass->GetSlot(propertyName);
-				if (slot == Compiler::VMClassValue::INVALID_SLOT)
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				VMStringValue* propertyName = static_cast<VMStringValue*>(nameValue.AsObject());
+				uint32_t slot = instance->shape->Find(propertyName);
+				if (slot == Shape::INVALID_SLOT)
 				{
-					RuntimeError(IP, "Undefined property '%s'.", propertyName.c_str());
+					RuntimeError(ip, "Undefined property '%s'.", propertyName->value.c_str());
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				VMValue valueToGet = instance->GetField(slot);
 				if (!valueToGet.IsValid())
 				{
-					RuntimeError(IP, "Undefined property '%s'.", propertyName.c_str());
+					RuntimeError(ip, "Undefined property '%s'.", propertyName->value.c_str());
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Push(valueToGet);
-				break;
+				PUSH(valueToGet);
+				DISPATCH();
 			}
-			case OP_SET_INDEX:
+			VM_CASE(OP_SET_INDEX):
 			{
-				VMValue valueToSet = Pop();
-				VMValue nameValue = Pop();
-				if (nameValue.type != TYPE_STRING || nameValue.object == nullptr)
+				// The operands stay on the stack while storing, growing the instance may collect.
+				VMValue valueToSet = PEEK(0);
+				VMValue nameValue = PEEK(1);
+				if (!nameValue.IsObjectType(TYPE_STRING))
 				{
-					RuntimeError(IP, "Property name must be a string.");
+					RuntimeError(ip, "Property name must be a string.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue object = Pop();
-				if (object.type != TYPE_INSTANCE || object.object == nullptr)
+				VMValue object = PEEK(2);
+				if (!object.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have properties.");
+					RuntimeError(ip, "Only instances have properties.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.object);
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.object);
-				const std::string& propertyName = static_cast<StringValue*>(nameValue.object)->value;
-				uint32_t slot = klass->GetOrCreateSlot(propertyName);
-				instance->SetField(slot, valueToSet);
-				Push(valueToSet);
-				break;
+				Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(object.AsObject());
+				VMStringValue* propertyName = static_cast<VMStringValue*>(nameValue.AsObject());
+				if (!StoreField(instance, propertyName, valueToSet, nullptr))
+				{
+					HeapLimitError(ip);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				DROP();
+				DROP();
+				DROP();
+				PUSH(valueToSet);
+				DISPATCH();
 			}
-			case OP_METHOD:
-			case OP_METHOD_LONG:
-			case OP_CLASS_METHOD:
-			case OP_CLASS_METHOD_LONG:
+			VM_CASE(OP_METHOD):
+			VM_CASE(OP_METHOD_LONG):
+			VM_CASE(OP_CLASS_METHOD):
+			VM_CASE(OP_CLASS_METHOD_LONG):
 			{
 				VMValue nameValue;
 				bool isStatic = opCode == OP_CLASS_METHOD || opCode == OP_CLASS_METHOD_LONG;
@@ -1328,54 +2087,59 @@ InterpretResult VM::Run()
 					nameValue = READ_CONSTANT();
 				else
 					nameValue = READ_LONG_CONSTANT();
-				VMValue methodValue = Pop();
-				VMValue classValue = Peek(0);
-				if (classValue.type != TYPE_CLASS || classValue.object == nullptr)
+				VMValue methodValue = POP();
+				VMValue classValue = PEEK(0);
+				if (!classValue.IsObjectType(TYPE_CLASS))
 				{
-					RuntimeError(IP, "Only classes can have methods.");
+					RuntimeError(ip, "Only classes can have methods.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.object);
-				if (methodValue.type != TYPE_CALLABLE || methodValue.object == nullptr)
+				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.AsObject());
+				if (!methodValue.IsObjectType(TYPE_CALLABLE))
 				{
-					RuntimeError(IP, "Method must be a callable.");
+					RuntimeError(ip, "Method must be a callable.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(methodValue.object);
+				Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(methodValue.AsObject());
 				if (functionValue->GetType() != Compiler::VM_FUNC_CLOSURE)
 				{
-					RuntimeError(IP, "Method must be a closure.");
+					RuntimeError(ip, "Method must be a closure.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				if (isStatic)
 				{
-					klass->classMethods[static_cast<StringValue*>(nameValue.object)->value] = methodValue;
+					klass->SetClassMethod(static_cast<VMStringValue*>(nameValue.AsObject()), methodValue);
 				}
 				else
 				{
-					klass->methods[static_cast<StringValue*>(nameValue.object)->value] = methodValue;
+					VMStringValue* methodName = static_cast<VMStringValue*>(nameValue.AsObject());
+					klass->SetMethod(methodName, methodValue);
+					if (methodName == initString)
+					{
+						klass->initializer = methodValue;
+					}
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_INHERIT:
+			VM_CASE(OP_INHERIT):
 			{
-				VMValue classValue = Pop();
-				VMValue superclassValue = Peek(0);
-				if (classValue.type != TYPE_CLASS || classValue.object == nullptr)
+				VMValue classValue = POP();
+				VMValue superclassValue = PEEK(0);
+				if (!classValue.IsObjectType(TYPE_CLASS))
 				{
-					RuntimeError(IP, "Can only inherit from a class.");
+					RuntimeError(ip, "Can only inherit from a class.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				if (superclassValue.type != TYPE_CLASS || superclassValue.object == nullptr)
+				if (!superclassValue.IsObjectType(TYPE_CLASS))
 				{
-					RuntimeError(IP, "Superclass must be a class.");
+					RuntimeError(ip, "Superclass must be a class.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				static_cast<Compiler::VMClassValue*>(classValue.object)->superClass = superclassValue;
-				break;
+				static_cast<Compiler::VMClassValue*>(classValue.AsObject())->Inherit(static_cast<Compiler::VMClassValue*>(superclassValue.AsObject()));
+				DISPATCH();
 			}
-			case OP_GET_SUPER:
-			case OP_GET_SUPER_LONG:
+			VM_CASE(OP_GET_SUPER):
+			VM_CASE(OP_GET_SUPER_LONG):
 			{
 				VMValue nameValue;
 				if (opCode == OP_GET_SUPER)
@@ -1385,54 +2149,52 @@ InterpretResult VM::Run()
 
 				uint32_t cacheIndex = (opCode == OP_GET_SUPER) ? READ_BYTE() : READ_THREE_BYTE();
 
-				VMValue superclassValue = Pop();
-				if (superclassValue.type != TYPE_CLASS || superclassValue.object == nullptr)
+				VMValue superclassValue = POP();
+				if (!superclassValue.IsObjectType(TYPE_CLASS))
 				{
-					RuntimeError(IP, "Superclass must be a class.");
+					RuntimeError(ip, "Superclass must be a class.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				VMValue instance = Pop();
-				if (instance.type != TYPE_INSTANCE || instance.object == nullptr)
+				VMValue instance = POP();
+				if (!instance.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have methods.");
+					RuntimeError(ip, "Only instances have methods.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(superclassValue.object);
-				const std::string& methodName = static_cast<StringValue*>(nameValue.object)->value;
-
-				InlineCache& cache = frames[frameCount - 1].GetChunk()->GetInlineCache(cacheIndex);
-				uint32_t slot = Compiler::VMClassValue::INVALID_SLOT;
+				Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(superclassValue.AsObject());
+				VMStringValue* methodName = static_cast<VMStringValue*>(nameValue.AsObject());
 
+				// Fields are not looked up through super, so the cache keys on the superclass.
+				InlineCache& cache = chunk->GetInlineCache(cacheIndex);
 				VMValue method;
-				const InlineCache::Entry* entry = cache.Match(klass, klass->slotNum);
+				const InlineCache::Entry* entry = cache.Match(klass->classId);
 				if (entry)
 				{
-					slot = entry->slot;
 					method = entry->method;
 				}
 				else
 				{
-					slot = klass->GetSlot(methodName);
 					method = klass->FindMethod(methodName);
-					if (slot == Compiler::VMClassValue::INVALID_SLOT && !method.object)
+					if (!method.AsObject())
 					{
-						RuntimeError(IP, "Undefined method '%s' in superclass.", methodName.c_str());
+						RuntimeError(ip, "Undefined method '%s' in superclass.", methodName->value.c_str());
 						return INTERPRET_RUNTIME_ERROR;
 					}
-					cache.Update(klass, klass->slotNum, slot, method);
+					cache.Update(klass->classId, Shape::INVALID_SLOT, method);
 				}
-				if (!method.object)
+				VMValue boundMethod = VM::Create(new Compiler::BoundMethodValue(instance, method));
+				if (!boundMethod.AsObject())
 				{
+					HeapLimitError(ip);
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				VMValue boundMethod = VM::Create(new Compiler::BoundMethodValue(instance, method));
-				Push(boundMethod);
-				break;
+				PUSH(boundMethod);
+				DISPATCH();
 			}
-			case OP_SUPER_INVOKE:
-			case OP_SUPER_INVOKE_LONG:
+			VM_CASE(OP_SUPER_INVOKE):
+			VM_CASE(OP_SUPER_INVOKE_LONG):
 			{
 				VMValue nameValue;
 				if (opCode == OP_SUPER_INVOKE)
@@ -1442,33 +2204,44 @@ InterpretResult VM::Run()
 				uint8_t argCountValue = READ_BYTE();
 				uint32_t cacheIndex = (opCode == OP_SUPER_INVOKE) ? READ_BYTE() : READ_THREE_BYTE();
 
-				VMValue superclassValue = Pop();
-				if (superclassValue.type != TYPE_CLASS || superclassValue.object == nullptr)
+				VMValue superclassValue = POP();
+				if (!superclassValue.IsObjectType(TYPE_CLASS))
 				{
-					RuntimeError(IP, "Superclass must be a class.");
+					RuntimeError(ip, "Superclass must be a class.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				VMValue instance = stackTop[-argCountValue - 1];
-				if (instance.type != TYPE_INSTANCE || instance.object == nullptr)
+				if (!instance.IsObjectType(TYPE_INSTANCE))
 				{
-					RuntimeError(IP, "Only instances have methods.");
+					RuntimeError(ip, "Only instances have methods.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				const std::string& methodName = static_cast<StringValue*>(nameValue.object)->value;
-				frames[frameCount - 1].ip = IP;
-				if (!InvokeFromClass(superclassValue, instance, methodName, argCountValue, cacheIndex, IP))
+				VMStringValue* methodName = static_cast<VMStringValue*>(nameValue.AsObject());
+				SAVE_IP();
+				if (!InvokeFromClass(superclassValue, instance, methodName, argCountValue, cacheIndex, ip))
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				IP = frames[frameCount - 1].ip;
-				break;
+				LOAD_FRAME();
+				DISPATCH();
 			}
+			default:
+				RuntimeError(ip, "Unknown opcode %d.", opCode);
+				return INTERPRET_RUNTIME_ERROR;
 		}
 	}
 
-	return INTERPRET_RUNTIME_ERROR;
+#undef SAVE_IP
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef TRACE_INSTRUCTION
+#undef VM_CASE
+#undef DISPATCH
 }
 
 InterpretResult VM::Interpret(VMValue function)
@@ -1477,6 +2250,11 @@ InterpretResult VM::Interpret(VMValue function)
 	Push(function);
 	VMValue closure = VM::Create(new Compiler::VMClosureValue(function, {}));
 	Pop();
+	if (!closure.AsObject())
+	{
+		HeapLimitError();
+		return INTERPRET_RUNTIME_ERROR;
+	}
 	Push(closure);
 	if (!Call(closure, 0))
 	{
@@ -1487,31 +2265,32 @@ InterpretResult VM::Interpret(VMValue function)
 
 bool VM::Call(VMValue callee, int argCount, const uint8_t* instructionIp)
 {
-	if ((callee.type != TYPE_CLASS && callee.type != TYPE_CALLABLE && callee.type != TYPE_BOUND_METHOD) ||
-		callee.object == nullptr)
+	ValueType calleeType = callee.GetType();
+	if ((calleeType != TYPE_CLASS && calleeType != TYPE_CALLABLE && calleeType != TYPE_BOUND_METHOD) ||
+		callee.AsObject() == nullptr)
 	{
 		RuntimeError(instructionIp, "Can't call a non-function value.");
 		return false;
 	}
 
-	if (callee.type == TYPE_CLASS)
+	if (calleeType == TYPE_CLASS)
 	{
-		Compiler::VMClassValue* classValue = static_cast<Compiler::VMClassValue*>(callee.object);
-		VMValue instance = VM::Create(new Compiler::VMInstanceValue(classValue));
+		Compiler::VMClassValue* classValue = static_cast<Compiler::VMClassValue*>(callee.AsObject());
+		VMValue instance = VM::Create(Compiler::VMInstanceValue::New(classValue));
+		if (!instance.AsObject())
+		{
+			HeapLimitError(instructionIp);
+			return false;
+		}
 		// Replace the callee on the stack with the new instance
 		stackTop[-argCount - 1] = instance;
-		auto initIt = classValue->methods.find("init");
-		if (initIt != classValue->methods.end())
+		// Initializers are not inherited. The instance already sits in the callee slot,
+		// so it becomes the receiver without a bound method.
+		if (classValue->initializer.IsValid())
 		{
-			VMValue initMethod = initIt->second;
-			VMValue boundMethod = VM::Create(new Compiler::BoundMethodValue(instance, initMethod));
-			stackTop[-argCount - 1] = boundMethod;
-			if (!Call(boundMethod, argCount, instructionIp))
-			{
-				return false;
-			}
+			return Invoke(instance, classValue->initializer, argCount, instructionIp);
 		}
-		else if (argCount > 0)
+		if (argCount > 0)
 		{
 			RuntimeError(instructionIp, "Expected 0 arguments but got %d.", argCount);
 			return false;
@@ -1520,9 +2299,9 @@ bool VM::Call(VMValue callee, int argCount, const uint8_t* instructionIp)
 	}
 
 	VMValue closure;
-	if (callee.type == TYPE_BOUND_METHOD)
+	if (calleeType == TYPE_BOUND_METHOD)
 	{
-		Compiler::BoundMethodValue* boundMethod = static_cast<Compiler::BoundMethodValue*>(callee.object);
+		Compiler::BoundMethodValue* boundMethod = static_cast<Compiler::BoundMethodValue*>(callee.AsObject());
 		closure = boundMethod->method;
 	}
 	else
@@ -1530,16 +2309,16 @@ bool VM::Call(VMValue callee, int argCount, const uint8_t* instructionIp)
 		closure = callee;
 	}
 
-	Compiler::VMClosureValue* closureValue = static_cast<Compiler::VMClosureValue*>(closure.object);
+	Compiler::VMClosureValue* closureValue = static_cast<Compiler::VMClosureValue*>(closure.AsObject());
 	VMValue function = closureValue->function;
 
-	if (function.type != TYPE_CALLABLE || function.object == nullptr)
+	if (!function.IsObjectType(TYPE_CALLABLE))
 	{
 		RuntimeError(instructionIp, "Can't call a non-function value.");
 		return false;
 	}
 
-	Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(function.object);
+	Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(function.AsObject());
 	if (functionValue->GetType() != Compiler::VM_FUNC_NATIVE && !function.GetChunk())
 	{
 		RuntimeError(instructionIp, "Can't call a non-function value.");
@@ -1555,7 +2334,7 @@ bool VM::Call(VMValue callee, int argCount, const uint8_t* instructionIp)
 
 	if (functionValue->GetType() == Compiler::VM_FUNC_NATIVE)
 	{
-		Compiler::NativeFunctionValue* nativeFunction = static_cast<Compiler::NativeFunctionValue*>(function.object);
+		Compiler::NativeFunctionValue* nativeFunction = static_cast<Compiler::NativeFunctionValue*>(function.AsObject());
 		VMValue result = nativeFunction->function(argCount, stackTop - argCount);
 		// Pop arguments and the callee
 		stackTop -= argCount + 1;
@@ -1570,32 +2349,71 @@ bool VM::Call(VMValue callee, int argCount, const uint8_t* instructionIp)
 			return false;
 		}
 
-		if (frameCount >= FRAMES_MAX)
+		// Reserve the whole frame once so the dispatch loop can push without checks.
+		// The callee slot and the arguments are already on the stack.
+		// This runs before PushFrame, a stack move must only rebase initialized frames.
+		EnsureStackCapacity((size_t)std::max(0, functionValue->maxStackSize - argCount - 1));
+		CallFrame* newFrame = PushFrame(instructionIp);
+		if (newFrame == nullptr)
 		{
-			RuntimeError(instructionIp, "Stack overflow: too many nested calls.");
 			return false;
 		}
 
-		CallFrame newFrame;
-		newFrame.closure = closure;
-		newFrame.ip = newFrame.GetChunk()->code;
-		newFrame.inner = VMValue();
+		newFrame->closure = closure;
+		newFrame->ip = newFrame->GetChunk()->code;
+		newFrame->inner = VMValue();
 		// Frame slots start at the callee slot, so locals can index from that base.
-		newFrame.slots = stackTop - argCount - 1;
+		newFrame->slots = stackTop - argCount - 1;
 		// If the callee is a bound method, the receiver is stored in slot 0 of the new frame.
-		if (callee.type == TYPE_BOUND_METHOD)
+		if (calleeType == TYPE_BOUND_METHOD)
 		{
-			newFrame.slots[0] = static_cast<Compiler::BoundMethodValue*>(callee.object)->receiver;
+			newFrame->slots[0] = static_cast<Compiler::BoundMethodValue*>(callee.AsObject())->receiver;
 		}
-		frames[frameCount++] = newFrame;
 	}
 
 	return true;
 }
 
+bool VM::TailCall(VMValue callee, int argCount, const uint8_t* instructionIp)
+{
+	// Only a bytecode closure with a matching arity takes over the frame. Classes, natives
+	// and every error case go through a regular call, the OP_RETURN after it then unwinds.
+	ValueType calleeType = callee.GetType();
+	if ((calleeType != TYPE_CALLABLE && calleeType != TYPE_BOUND_METHOD) || callee.AsObject() == nullptr)
+	{
+		return Call(callee, argCount, instructionIp);
+	}
+
+	VMValue closure = callee;
+	if (calleeType == TYPE_BOUND_METHOD)
+	{
+		closure = static_cast<Compiler::BoundMethodValue*>(callee.AsObject())->method;
+	}
+	VMValue function = static_cast<Compiler::VMClosureValue*>(closure.AsObject())->function;
+	if (!function.IsObjectType(TYPE_CALLABLE))
+	{
+		return Call(callee, argCount, instructionIp);
+	}
+	Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(function.AsObject());
+	if (functionValue->GetType() == Compiler::VM_FUNC_NATIVE || !function.GetChunk() || functionValue->Arity() != argCount)
+	{
+		return Call(callee, argCount, instructionIp);
+	}
+
+	// Close the caller's captured locals before the callee overwrites its slots.
+	CallFrame& frame = frames[frameCount - 1];
+	CloseUpvalues(frame.slots);
+	VMValue* calleeSlot = stackTop - argCount - 1;
+	std::copy(calleeSlot, stackTop, frame.slots);
+	stackTop = frame.slots + argCount + 1;
+	// Call pushes the new frame into the slot just released, it cannot fail from here.
+	--frameCount;
+	return Call(callee, argCount, instructionIp);
+}
+
 bool VM::Invoke(VMValue receiver, VMValue method, int argCount, const uint8_t* instructionIp)
 {
-	Compiler::VMClosureValue* closureValue = static_cast<Compiler::VMClosureValue*>(method.object);
+	Compiler::VMClosureValue* closureValue = static_cast<Compiler::VMClosureValue*>(method.AsObject());
 	int expectedArgCount = closureValue->Arity();
 	if (argCount != expectedArgCount)
 	{
@@ -1603,35 +2421,35 @@ bool VM::Invoke(VMValue receiver, VMValue method, int argCount, const uint8_t* i
 		return false;
 	}
 
-	if (frameCount >= FRAMES_MAX)
+	Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(closureValue->function.AsObject());
+	EnsureStackCapacity((size_t)std::max(0, functionValue->maxStackSize - argCount - 1));
+	CallFrame* newFrame = PushFrame(instructionIp);
+	if (newFrame == nullptr)
 	{
-		RuntimeError(instructionIp, "Stack overflow: too many nested calls.");
 		return false;
 	}
 
-	CallFrame newFrame;
-	newFrame.closure = method;
-	newFrame.ip = newFrame.GetChunk()->code;
-	newFrame.slots = stackTop - argCount - 1;
-	newFrame.slots[0] = receiver;
-	newFrame.inner = VMValue();
-	frames[frameCount++] = newFrame;
+	newFrame->closure = method;
+	newFrame->ip = newFrame->GetChunk()->code;
+	newFrame->slots = stackTop - argCount - 1;
+	newFrame->slots[0] = receiver;
+	newFrame->inner = VMValue();
 	return true;
 }
 
-bool VM::InvokeClassMethod(VMValue classValue, const std::string& methodName, int argCount, const uint8_t* instructionIp)
+bool VM::InvokeClassMethod(VMValue classValue, VMStringValue* methodName, int argCount, const uint8_t* instructionIp)
 {
-	if (classValue.type != TYPE_CLASS || classValue.object == nullptr)
+	if (!classValue.IsObjectType(TYPE_CLASS))
 	{
 		RuntimeError(instructionIp, "Only classes have class methods.");
 		return false;
 	}
 
-	Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.object);
+	Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.AsObject());
 	VMValue method = klass->FindClassMethod(methodName);
-	if (method.type != TYPE_CALLABLE || method.object == nullptr)
+	if (!method.IsObjectType(TYPE_CALLABLE))
 	{
-		RuntimeError(instructionIp, "Undefined class method '%s'.", methodName.c_str());
+		RuntimeError(instructionIp, "Undefined class method '%s'.", methodName->value.c_str());
 		return false;
 	}
 
@@ -1640,15 +2458,18 @@ bool VM::InvokeClassMethod(VMValue classValue, const std::string& methodName, in
 	return Call(method, argCount, instructionIp);
 }
 
-bool VM::InvokeFromClass(VMValue classValue, VMValue receiver, const std::string& methodName, int argCount, uint32_t cacheIndex, const uint8_t* instructionIp)
+bool VM::InvokeFromClass(VMValue classValue, VMValue receiver, VMStringValue* methodName, int argCount, uint32_t cacheIndex, const uint8_t* instructionIp)
 {
-	Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.object);
-	Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(receiver.object);
+	Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(classValue.AsObject());
+	Compiler::VMInstanceValue* instance = static_cast<Compiler::VMInstanceValue*>(receiver.AsObject());
 	InlineCache& cache = frames[frameCount - 1].GetChunk()->GetInlineCache(cacheIndex);
+	// A field can shadow a method on the receiver's own class, super invokes only see methods.
+	bool isSuper = classValue.AsObject() != instance->classValue.AsObject();
+	uint64_t cacheId = isSuper ? klass->classId : instance->shape->id;
 
-	uint32_t slot = Compiler::VMClassValue::INVALID_SLOT;
+	uint32_t slot = Shape::INVALID_SLOT;
 	VMValue method;
-	const InlineCache::Entry* entry = cache.Match(klass, klass->slotNum);
+	const InlineCache::Entry* entry = cache.Match(cacheId);
 	if (entry)
 	{
 		slot = entry->slot;
@@ -1656,37 +2477,28 @@ bool VM::InvokeFromClass(VMValue classValue, VMValue receiver, const std::string
 	}
 	else
 	{
-		slot = klass->GetSlot(methodName);
-		method = klass->FindMethod(methodName);
-		if (slot == Compiler::VMClassValue::INVALID_SLOT && !method.object)
+		if (!isSuper)
 		{
-			if (classValue.object == instance->classValue.object)
-			{
-				RuntimeError(instructionIp, "Undefined method '%s'.", methodName.c_str());
-			}
-			else
-			{
-				RuntimeError(instructionIp, "Undefined method '%s' in superclass.", methodName.c_str());
-			}
-			return false;
+			slot = instance->shape->Find(methodName);
 		}
-		cache.Update(klass, klass->slotNum, slot, method);
+		method = klass->FindMethod(methodName);
+		cache.Update(cacheId, slot, method);
 	}
 
 	VMValue callee;
-	if (classValue.object == instance->classValue.object && slot != Compiler::VMClassValue::INVALID_SLOT)
+	if (slot != Shape::INVALID_SLOT)
 	{
 		callee = instance->GetField(slot);
 	}
 	if (!callee.IsValid() && !method.IsValid())
 	{
-		if (classValue.object == instance->classValue.object)
+		if (isSuper)
 		{
-			RuntimeError(instructionIp, "Undefined method '%s'.", methodName.c_str());
+			RuntimeError(instructionIp, "Undefined method '%s' in superclass.", methodName->value.c_str());
 		}
 		else
 		{
-			RuntimeError(instructionIp, "Undefined method '%s' in superclass.", methodName.c_str());
+			RuntimeError(instructionIp, "Undefined method '%s'.", methodName->value.c_str());
 		}
 		return false;
 	}
@@ -1696,21 +2508,68 @@ bool VM::InvokeFromClass(VMValue classValue, VMValue receiver, const std::string
 		: Invoke(receiver, method, argCount, instructionIp);
 }
 
-void VM::DefineNative(const std::string& name, Compiler::NativeFn function, int32_t arity)
+bool VM::StoreField(Compiler::VMInstanceValue* instance, VMStringValue* fieldName, VMValue value, InlineCache* cache)
 {
-	size_t slot = -1;
-	if (ResolveOrCreateGlobalSlot(VM::Create(StringValue::CreateRaw(name)), slot))
+	const InlineCache::Entry* entry = cache ? cache->Match(instance->shape->id) : nullptr;
+	if (entry == nullptr)
+	{
+		Shape* from = instance->shape;
+		uint32_t slot = from->Find(fieldName);
+		Shape* transition = nullptr;
+		if (slot == Shape::INVALID_SLOT)
+		{
+			Compiler::VMClassValue* klass = static_cast<Compiler::VMClassValue*>(instance->classValue.AsObject());
+			transition = klass->Transition(from, fieldName);
+			if (!transition)
+			{
+				return false;
+			}
+			slot = from->fieldCount;
+		}
+		if (cache)
+		{
+			cache->Update(from->id, slot, VMValue(), transition);
+		}
+		if (transition)
+		{
+			if (!instance->AddField(transition, value))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			instance->SetField(slot, value);
+		}
+	}
+	else if (entry->transition)
 	{
-		VMValue nativeValue = VM::Create(new Compiler::NativeFunctionValue(name, function, arity));
-		Push(nativeValue);
-		VMValue closure = VM::Create(new Compiler::VMClosureValue(nativeValue, {}));
-		Pop();
-		globalSlots[slot] = closure;
+		if (!instance->AddField(entry->transition, value))
+		{
+			return false;
+		}
 	}
 	else
 	{
-		RuntimeError("Failed to define native function '%s'.", name.c_str());
+		instance->SetField(entry->slot, value);
+	}
+	WriteBarrier(instance, value);
+	return true;
+}
+
+void VM::DefineNative(const std::string& name, Compiler::NativeFn function, int32_t arity)
+{
+	size_t slot = ReserveGlobalSlot(name);
+	VMValue nativeValue = VM::Create(new Compiler::NativeFunctionValue(name, function, arity));
+	if (!nativeValue.AsObject())
+	{
+		// Over the heap cap, the global stays undefined.
+		return;
 	}
+	Push(nativeValue);
+	VMValue closure = VM::Create(new Compiler::VMClosureValue(nativeValue, {}));
+	Pop();
+	globalSlots[slot] = closure;
 }
 
 InterpretResult VM::Interpret(const char* source)
@@ -1718,7 +2577,7 @@ InterpretResult VM::Interpret(const char* source)
 	Compiler compiler;
 
 	VMValue compiledFunction = compiler.Compile(source);
-	if (compiledFunction.type != TYPE_CALLABLE || compiledFunction.object == nullptr)
+	if (!compiledFunction.IsObjectType(TYPE_CALLABLE))
 	{
 		return INTERPRET_COMPILE_ERROR;
 	}
@@ -1729,6 +2588,11 @@ InterpretResult VM::Interpret(const char* source)
 	VMValue scriptClosure = VM::Create(new Compiler::VMClosureValue(compiledFunction, {}));
 	// Remove the compiled function from the stack since it's now referenced by the closure
 	Pop();
+	if (!scriptClosure.AsObject())
+	{
+		HeapLimitError();
+		return INTERPRET_RUNTIME_ERROR;
+	}
 
 	// Slot 0 is reserved by the compiler for the implicit "function" object.	
 	Push(scriptClosure);
@@ -1744,54 +2608,280 @@ InterpretResult VM::Interpret(const char* source)
 	return result;
 }
 
+namespace
+{
+	// Gray objects owned by one marking thread. The owner works off the private stack and
+	// publishes a batch to the shared queue whenever it runs dry, idle workers steal from there.
+	struct MarkWorker
+	{
+		std::vector<VMObject*> local;
+		std::mutex sharedLock;
+		std::vector<VMObject*> shared;
+		std::atomic<size_t> sharedCount{ 0 };
+	};
+
+	// Batches smaller than this stay private, stealing them costs more than tracing them.
+	constexpr size_t MARK_SHARE_BATCH = 64;
+
+	// Set on every thread taking part in a parallel mark, MarkValue pushes there instead of the gray stack.
+	thread_local MarkWorker* currentMarkWorker = nullptr;
+
+	struct ParallelMark
+	{
+		std::vector<MarkWorker> workers;
+		std::atomic<size_t> idleWorkers{ 0 };
+		// Objects sitting in shared queues, lets idle workers wait without taking locks.
+		std::atomic<size_t> sharedTotal{ 0 };
+
+		explicit ParallelMark(size_t workerCount) : workers(workerCount) {}
+
+		void Publish(MarkWorker& worker)
+		{
+			size_t count = worker.local.size() / 2;
+			std::lock_guard<std::mutex> guard(worker.sharedLock);
+			// The oldest entries sit closest to the roots and tend to lead to the most work.
+			worker.shared.insert(worker.shared.end(), worker.local.begin(), worker.local.begin() + count);
+			worker.local.erase(worker.local.begin(), worker.local.begin() + count);
+			worker.sharedCount.fetch_add(count);
+			sharedTotal.fetch_add(count);
+		}
+
+		bool Steal(size_t self)
+		{
+			MarkWorker& thief = workers[self];
+			for (size_t i = 0; i < workers.size(); ++i)
+			{
+				MarkWorker& victim = workers[(self + i) % workers.size()];
+				if (victim.sharedCount.load() == 0)
+				{
+					continue;
+				}
+				std::lock_guard<std::mutex> guard(victim.sharedLock);
+				// Take half so several thieves can share one victim's backlog.
+				size_t count = (victim.shared.size() + 1) / 2;
+				if (count == 0)
+				{
+					continue;
+				}
+				thief.local.insert(thief.local.end(), victim.shared.end() - count, victim.shared.end());
+				victim.shared.erase(victim.shared.end() - count, victim.shared.end());
+				victim.sharedCount.fetch_sub(count);
+				sharedTotal.fetch_sub(count);
+				return true;
+			}
+			return false;
+		}
+
+		void Run(VM& vm, size_t self)
+		{
+			MarkWorker& worker = workers[self];
+			currentMarkWorker = &worker;
+			for (;;)
+			{
+				while (!worker.local.empty())
+				{
+					VMObject* value = worker.local.back();
+					worker.local.pop_back();
+					BlackenObject(vm, value);
+					if (worker.local.size() >= MARK_SHARE_BATCH * 2 && worker.sharedCount.load(std::memory_order_relaxed) == 0)
+					{
+						Publish(worker);
+					}
+				}
+				if (Steal(self))
+				{
+					continue;
+				}
+				// Every worker idle with nothing shared means no gray object is left anywhere.
+				idleWorkers.fetch_add(1);
+				for (;;)
+				{
+					if (sharedTotal.load() != 0)
+					{
+						idleWorkers.fetch_sub(1);
+						break;
+					}
+					if (idleWorkers.load() == workers.size())
+					{
+						currentMarkWorker = nullptr;
+						return;
+					}
+					std::this_thread::yield();
+				}
+			}
+		}
+	};
+}
+
 void VM::MarkValue(VMValue value)
 {
-	if (!value.IsObject() || value.object == nullptr || value.object->markedValue == currentMarkValue)
+	if (!value.IsObject() || value.AsObject() == nullptr || value.AsObject()->markedValue.load(std::memory_order_relaxed) == currentMarkValue)
+	{
+		return;
+	}
+	// Old objects are only reached through the remembered set during a minor collection.
+	if (collectingYoung && value.AsObject()->isOld)
 	{
 		return;
 	}
 #ifdef DEBUG_LOG_GC
-	printf("  Mark object %p of type %s\n", (void*)value.object, ValueTypeToString(value.object->type));
+	printf("  Mark object %p of type %s\n", (void*)value.AsObject(), ValueTypeToString(value.AsObject()->type));
 #endif
-	value.object->markedValue = currentMarkValue;
+	if (currentMarkWorker != nullptr)
+	{
+		// Several workers can reach the same object, only the one that flips the bit traces it.
+		if (value.AsObject()->markedValue.exchange(currentMarkValue, std::memory_order_relaxed) != currentMarkValue)
+		{
+			currentMarkWorker->local.push_back(value.AsObject());
+		}
+		return;
+	}
+	value.AsObject()->markedValue.store(currentMarkValue, std::memory_order_relaxed);
 	if (grayStackCount + 1 > grayStackCapacity)
 	{
 		size_t oldCapacity = grayStackCapacity;
 		size_t newCapacity = oldCapacity == 0 ? 8 : oldCapacity * 2;
-		grayStack = GROW_ARRAY(Value*, grayStack, oldCapacity, newCapacity);
+		grayStack = GROW_ARRAY(VMObject*, grayStack, oldCapacity, newCapacity);
 		grayStackCapacity = newCapacity;
 	}
-	grayStack[grayStackCount++] = value.object;
+	grayStack[grayStackCount++] = value.AsObject();
 }
 
 void VM::TraceReferences()
 {
+	size_t tracedBytes = collectingYoung ? youngBytes : bytesAllocated;
+	if (gcWorkerCount > 1 && grayStackCount > 0 && tracedBytes >= parallelMarkMinBytes)
+	{
+		TraceReferencesParallel();
+		return;
+	}
 	while (grayStackCount > 0)
 	{
-		Value* value = grayStack[--grayStackCount];
+		VMObject* value = grayStack[--grayStackCount];
 #ifdef DEBUG_LOG_GC
 		printf("  Blacken object %p of type %s\n", (void*)value, ValueTypeToString(value->type));
 #endif
-		value->Blacken(*this);
+		BlackenObject(*this, value);
 	}
 }
 
-void VM::Sweep()
+void VM::TraceReferencesParallel()
 {
-	for (Value* object = objects; object != nullptr; )
+	ParallelMark mark(gcWorkerCount);
+	// Deal the roots out round robin, stealing evens out the rest.
+	for (size_t i = 0; i < grayStackCount; ++i)
+	{
+		mark.workers[i % gcWorkerCount].local.push_back(grayStack[i]);
+	}
+	grayStackCount = 0;
+
+	std::vector<std::thread> threads;
+	threads.reserve(gcWorkerCount - 1);
+	for (size_t i = 1; i < gcWorkerCount; ++i)
+	{
+		threads.emplace_back([this, &mark, i]() { mark.Run(*this, i); });
+	}
+	// The calling thread is worker 0.
+	mark.Run(*this, 0);
+	for (std::thread& thread : threads)
 	{
+		thread.join();
+	}
+}
+
+size_t VM::SweepStep(size_t budget)
+{
+	// Track the last surviving object so dead ones are unlinked in the same pass.
+	size_t work = 0;
+	size_t bytesBefore = bytesAllocated;
+	while (sweepCursor != nullptr && work < budget)
+	{
+		VMObject* object = sweepCursor;
+		sweepCursor = object->nextGCValue;
+		size_t objectSize = ObjectSize(object);
+		work += objectSize;
 		if (object->markedValue != currentMarkValue)
 		{
-			Value* unreached = object;
-			object = object->nextGCValue;
-			FreeValue(unreached);
+			if (sweepPrevious != nullptr)
+			{
+				sweepPrevious->nextGCValue = sweepCursor;
+			}
+			else
+			{
+				objects = sweepCursor;
+			}
+			FreeValue(object);
 		}
 		else
 		{
-			object = object->nextGCValue;
+			sweepPrevious = object;
+			cycleMarkedBytes += objectSize;
 		}
 	}
-	currentMarkValue = !currentMarkValue;
+	cycleSweptBytes += bytesBefore - bytesAllocated;
+	return work;
+}
+
+size_t VM::SweepYoung()
+{
+	size_t promotedBytes = 0;
+	// While old objects wait to be swept, marked means live, so survivors keep the mark until the cycle flips it.
+	bool survivorMark = gcPhase == GC_PHASE_SWEEP ? currentMarkValue : !currentMarkValue;
+	for (VMObject* object = youngObjects; object != nullptr; )
+	{
+		VMObject* next = object->nextGCValue;
+		if (object->markedValue != currentMarkValue)
+		{
+			FreeValue(object);
+		}
+		else
+		{
+			// Survivors move to the old generation unmarked, old objects keep their marks between full collections.
+			promotedBytes += ObjectSize(object);
+			object->isOld = true;
+			object->markedValue.store(survivorMark, std::memory_order_relaxed);
+			object->nextGCValue = objects;
+			// The first survivor links to the object the pending sweep starts from, so it stands in as the last survivor before it.
+			if (gcPhase == GC_PHASE_SWEEP && sweepPrevious == nullptr)
+			{
+				sweepPrevious = object;
+			}
+			objects = object;
+		}
+		object = next;
+	}
+	youngObjects = nullptr;
+	youngBytes = 0;
+	return promotedBytes;
+}
+
+void VM::PromoteYoung()
+{
+	if (youngObjects == nullptr)
+	{
+		return;
+	}
+	// Splice the nursery in front of the old generation so a full sweep sees every object once.
+	VMObject* tail = youngObjects;
+	tail->isOld = true;
+	while (tail->nextGCValue != nullptr)
+	{
+		tail = tail->nextGCValue;
+		tail->isOld = true;
+	}
+	tail->nextGCValue = objects;
+	objects = youngObjects;
+	youngObjects = nullptr;
+	youngBytes = 0;
+}
+
+void VM::ClearRememberedSet()
+{
+	for (VMObject* owner : rememberedSet)
+	{
+		owner->isRemembered = false;
+	}
+	rememberedSet.clear();
 }
 
 void VM::MarkRoots()
@@ -1814,6 +2904,7 @@ void VM::MarkRoots()
 	{
 		MarkValue(global);
 	}
+	MarkValue(VMValue(initString));
 	MarkCompilerRoots();
 }
 
@@ -1828,44 +2919,299 @@ void VM::MarkCompilerRoots()
 	}
 }
 
-void VM::InvalidateInlineCaches()
+void VM::CollectGarbage()
 {
-	for (Value* object = objects; object != nullptr; object = object->nextGCValue)
+	BeginGCPause();
+	// A full collection requested mid-cycle just finishes the cycle.
+	if (gcPhase != GC_PHASE_IDLE)
 	{
-		if (object->type != TYPE_CALLABLE)
+		while (gcPhase != GC_PHASE_IDLE)
 		{
-			continue;
+			GCSlice(SIZE_MAX);
 		}
+		EndGCPause();
+		return;
+	}
+#ifdef DEBUG_LOG_GC
+	printf("GC Begin\n");
+#endif
+	MarkRoots();
+	TraceReferences();
+	PromoteYoung();
+	ClearRememberedSet();
+	// The pause ends here, allocations sweep the dead objects lazily.
+	StartSweep();
+	EndGCPause();
+}
 
-		Compiler::VMFunctionBase* functionValue = static_cast<Compiler::VMFunctionBase*>(object);
-		Chunk* chunk = functionValue->GetChunk();
-		if (chunk != nullptr)
-		{
-			chunk->InvalidateInlineCaches();
-		}
+void VM::CollectAllGarbage()
+{
+	// A running cycle may have marked objects that died since, finish it and start over.
+	if (gcPhase != GC_PHASE_IDLE)
+	{
+		CollectGarbage();
+	}
+	CollectGarbage();
+	// The caller needs the memory now, so sweep instead of leaving it to later allocations.
+	while (gcPhase != GC_PHASE_IDLE)
+	{
+		GCSlice(SIZE_MAX);
 	}
 }
 
-void VM::CollectGarbage()
+void VM::CollectYoungGarbage()
 {
+	// The nursery is left alone until incremental marking completes.
+	if (gcPhase == GC_PHASE_MARK)
+	{
+		return;
+	}
+	BeginGCPause();
 #ifdef DEBUG_LOG_GC
-	printf("GC Begin\n");
+	printf("Minor GC Begin\n");
 #endif
+	size_t bytesBefore = bytesAllocated;
+	collectingYoung = true;
 	MarkRoots();
+	for (VMObject* owner : rememberedSet)
+	{
+		BlackenObject(*this, owner);
+	}
 	TraceReferences();
-	Sweep();
-	// Inline caches keep raw class identities, so a GC cycle invalidates them.
-	InvalidateInlineCaches();
-	nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
-	if (nextGC < INITIAL_GC_THRESHOLD)
+	size_t promotedBytes = SweepYoung();
+	collectingYoung = false;
+	// The nursery is empty now, so no old object can point into it.
+	ClearRememberedSet();
+
+	gcStats.minor.count++;
+	gcStats.minor.lastSweptBytes = bytesBefore - bytesAllocated;
+	gcStats.minor.lastMarkedBytes = promotedBytes;
+	gcStats.minor.totalSweptBytes += gcStats.minor.lastSweptBytes;
+	gcStats.minor.totalMarkedBytes += gcStats.minor.lastMarkedBytes;
+	EndGCPause();
+#ifdef DEBUG_LOG_GC
+	printf("Minor GC End (%zu bytes allocated)\n", bytesAllocated);
+#endif
+}
+
+void VM::StartGCCycle()
+{
+#ifdef DEBUG_LOG_GC
+	printf("Incremental GC Begin\n");
+#endif
+	BeginGCPause();
+	// The whole heap takes part, so the nursery joins the old generation up front.
+	PromoteYoung();
+	ClearRememberedSet();
+	gcPhase = GC_PHASE_MARK;
+	gcDebt = 0;
+	MarkRoots();
+	EndGCPause();
+}
+
+void VM::GCSlice(size_t budget)
+{
+	BeginGCPause();
+	size_t work = 0;
+	if (gcPhase == GC_PHASE_MARK)
 	{
-		nextGC = INITIAL_GC_THRESHOLD;
+		while (grayStackCount > 0 && work < budget)
+		{
+			VMObject* value = grayStack[--grayStackCount];
+			BlackenObject(*this, value);
+			work += ObjectSize(value);
+		}
+		if (grayStackCount == 0)
+		{
+			FinishMarking();
+		}
+	}
+	else if (gcPhase == GC_PHASE_SWEEP)
+	{
+		SweepStep(budget);
+		if (sweepCursor == nullptr)
+		{
+			FinishGCCycle();
+		}
 	}
+	EndGCPause();
+}
+
+void VM::FinishMarking()
+{
+	// Roots are not behind the write barrier, so they are scanned again before anything is freed.
+	MarkRoots();
+	TraceReferences();
+	// Objects born while marking are marked, they join the old generation so minor collections during the sweep never see them.
+	PromoteYoung();
+	ClearRememberedSet();
+	StartSweep();
+}
+
+void VM::StartSweep()
+{
+	gcPhase = GC_PHASE_SWEEP;
+	gcDebt = 0;
+	sweepCursor = objects;
+	sweepPrevious = nullptr;
+	cycleMarkedBytes = 0;
+	cycleSweptBytes = 0;
+}
+
+void VM::FinishGCCycle()
+{
+	// Nursery objects are unmarked and must stay so across the flip.
+	for (VMObject* object = youngObjects; object != nullptr; object = object->nextGCValue)
+	{
+		object->markedValue.store(currentMarkValue, std::memory_order_relaxed);
+	}
+	currentMarkValue = !currentMarkValue;
+	gcPhase = GC_PHASE_IDLE;
+	sweepPrevious = nullptr;
+	// A large factor can take the product past what size_t holds, converting that would be undefined.
+	double threshold = (double)bytesAllocated * gcConfig.growFactor;
+	nextGC = ClampGCThreshold(threshold < (double)SIZE_MAX ? (size_t)threshold : SIZE_MAX);
+
+	gcStats.full.count++;
+	gcStats.full.lastSweptBytes = cycleSweptBytes;
+	gcStats.full.lastMarkedBytes = cycleMarkedBytes;
+	gcStats.full.totalSweptBytes += gcStats.full.lastSweptBytes;
+	gcStats.full.totalMarkedBytes += gcStats.full.lastMarkedBytes;
 #ifdef DEBUG_LOG_GC
 	printf("GC End (%zu bytes allocated, next at %zu)\n", bytesAllocated, nextGC);
 #endif
 }
 
+void VM::SetIncrementalGC(bool enabled, size_t sliceBytes)
+{
+	// Switching modes mid-cycle finishes the cycle first.
+	if (!enabled && gcPhase != GC_PHASE_IDLE)
+	{
+		CollectGarbage();
+	}
+	incrementalGC = enabled;
+	gcSliceBytes = sliceBytes == 0 ? 1 : sliceBytes;
+}
+
+void VM::SetGCWorkerCount(size_t workerCount, size_t minHeapBytes)
+{
+	gcWorkerCount = workerCount == 0 ? 1 : workerCount;
+	parallelMarkMinBytes = minHeapBytes;
+}
+
+VM::GCConfig VM::GCConfig::FromEnvironment()
+{
+	GCConfig config;
+	ReadSizeEnvironment("LOX_GC_INITIAL_THRESHOLD", config.initialThreshold);
+	ReadFactorEnvironment("LOX_GC_GROW_FACTOR", config.growFactor);
+	ReadSizeEnvironment("LOX_GC_MIN_HEAP", config.minHeap);
+	ReadSizeEnvironment("LOX_GC_MAX_HEAP", config.maxHeap);
+	config.growFactor = ValidGrowFactor(config.growFactor);
+	return config;
+}
+
+double VM::GCConfig::ValidGrowFactor(double factor)
+{
+	// NaN fails every comparison, so it is rejected along with infinities. A heap that may not grow
+	// would be collected on every allocation.
+	if (!std::isfinite(factor) || !(factor > 1.0))
+	{
+		return DEFAULT_GC_GROW_FACTOR;
+	}
+	return factor;
+}
+
+void VM::SetGCConfig(const GCConfig& config)
+{
+	gcConfig = config;
+	gcConfig.growFactor = GCConfig::ValidGrowFactor(gcConfig.growFactor);
+	nextGC = ClampGCThreshold(nextGC);
+}
+
+void VM::BeginGCPause()
+{
+	if (gcPauseDepth++ == 0)
+	{
+		gcPauseStart = std::chrono::steady_clock::now();
+	}
+}
+
+void VM::EndGCPause()
+{
+	if (--gcPauseDepth != 0)
+	{
+		return;
+	}
+	uint64_t nanos = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gcPauseStart).count();
+	size_t bucket = 0;
+	for (uint64_t micros = nanos / 1000; micros > 0 && bucket + 1 < GCStats::PAUSE_BUCKETS; micros >>= 1)
+	{
+		++bucket;
+	}
+	gcStats.pauseHistogram[bucket]++;
+	gcStats.pauseCount++;
+	gcStats.totalPauseNanos += nanos;
+	gcStats.maxPauseNanos = std::max(gcStats.maxPauseNanos, nanos);
+}
+
+VM::GCStats VM::GetGCStats() const
+{
+	GCStats stats = gcStats;
+	stats.elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - gcStatsStart).count();
+	for (VMObject* list : { objects, youngObjects })
+	{
+		for (VMObject* object = list; object != nullptr; object = object->nextGCValue)
+		{
+			size_t objectSize = ObjectSize(object);
+			stats.objectCounts[object->type]++;
+			stats.objectBytes[object->type] += objectSize;
+			stats.heapBytes += objectSize;
+		}
+	}
+	return stats;
+}
+
+std::string VM::GCStats::ToString() const
+{
+	std::ostringstream out;
+	out << "collections: " << minor.count << " minor, " << full.count << " full\n";
+	out << "minor: last marked " << minor.lastMarkedBytes << " swept " << minor.lastSweptBytes
+		<< " bytes, total marked " << minor.totalMarkedBytes << " swept " << minor.totalSweptBytes << " bytes\n";
+	out << "full: last marked " << full.lastMarkedBytes << " swept " << full.lastSweptBytes
+		<< " bytes, total marked " << full.totalMarkedBytes << " swept " << full.totalSweptBytes << " bytes\n";
+	out << "pauses: " << pauseCount << ", total " << totalPauseNanos / 1000 << " us, max " << maxPauseNanos / 1000 << " us\n";
+	for (size_t i = 0; i < PAUSE_BUCKETS; ++i)
+	{
+		if (pauseHistogram[i] != 0)
+		{
+			out << "  < " << (1ull << i) << " us: " << pauseHistogram[i] << "\n";
+		}
+	}
+	out << "allocated: " << allocatedBytes << " bytes, " << (uint64_t)AllocationRate() << " bytes/s\n";
+	out << "heap: " << heapBytes << " bytes\n";
+	for (size_t type = 0; type <= TYPE_ERROR; ++type)
+	{
+		if (objectCounts[type] != 0)
+		{
+			out << "  " << ValueTypeToString((ValueType)type) << ": " << objectCounts[type] << " objects, " << objectBytes[type] << " bytes\n";
+		}
+	}
+	return out.str();
+}
+
+size_t VM::ClampGCThreshold(size_t threshold) const
+{
+	if (threshold < gcConfig.minHeap)
+	{
+		threshold = gcConfig.minHeap;
+	}
+	if (gcConfig.maxHeap != 0 && threshold > gcConfig.maxHeap)
+	{
+		threshold = gcConfig.maxHeap;
+	}
+	return threshold;
+}
+
 void VM::Repl()
 {
 	char line[1024];
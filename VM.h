@@ -1,6 +1,8 @@
 #pragma once
 #include "Chunk.h"
 #include "Compiler.h"
+#include "StringTable.h"
+#include <chrono>
 #include <unordered_map>
 #include <vector>
 
@@ -23,11 +25,11 @@ struct CallFrame
 
 	inline Chunk* GetChunk()
 	{
-		return static_cast<Compiler::VMClosureValue*>(closure.object)->function.GetChunk();
+		return static_cast<Compiler::VMFunctionBase*>(static_cast<Compiler::VMClosureValue*>(closure.AsObject())->function.AsObject())->GetChunk();
 	}
 	inline std::vector<VMValue>& GetUpvalues()
 	{
-		return static_cast<Compiler::VMClosureValue*>(closure.object)->upvalues;
+		return static_cast<Compiler::VMClosureValue*>(closure.AsObject())->upvalues;
 	}
 };
 
@@ -36,16 +38,90 @@ class VM
 public:
 	friend struct VMValue;
 	friend class Compiler;
-	Value* objects = nullptr;
+	// Old generation, objects that survived at least one collection.
+	VMObject* objects = nullptr;
 protected:
 	static VM* instance;
 
-	static constexpr uint32_t FRAMES_MAX = 64;
-	static constexpr uint32_t STACK_MAX = FRAMES_MAX * 255;
-	static constexpr size_t INITIAL_GC_THRESHOLD = 1024 * 1024;
-	static constexpr size_t GC_HEAP_GROW_FACTOR = 2;
+	static constexpr uint32_t INITIAL_FRAME_CAPACITY = 64;
+	static constexpr uint32_t DEFAULT_MAX_FRAMES = 1 << 16;
+	static constexpr uint32_t INITIAL_STACK_CAPACITY = INITIAL_FRAME_CAPACITY * 255;
+	static constexpr size_t DEFAULT_GC_INITIAL_THRESHOLD = 1024 * 1024;
+	static constexpr double DEFAULT_GC_GROW_FACTOR = 2.0;
+	// Bytes allocated into the nursery before a minor collection runs.
+	static constexpr size_t NURSERY_SIZE = 256 * 1024;
+	static constexpr size_t DEFAULT_GC_SLICE_BYTES = 64 * 1024;
+	// A slice traces or sweeps this multiple of the bytes allocated since the previous slice, so the collector outpaces the program.
+	static constexpr size_t GC_SLICE_WORK_FACTOR = 2;
+	// Heaps smaller than this are traced on one thread, starting workers would cost more than it saves.
+	static constexpr size_t DEFAULT_PARALLEL_MARK_MIN_BYTES = 4 * 1024 * 1024;
 
-	struct UpvalueValue : public Value
+	enum GCPhase
+	{
+		GC_PHASE_IDLE,
+		GC_PHASE_MARK,
+		GC_PHASE_SWEEP
+	};
+
+public:
+	// Heap sizing of full collections. The defaults can be overridden through the LOX_GC_INITIAL_THRESHOLD,
+	// LOX_GC_GROW_FACTOR, LOX_GC_MIN_HEAP and LOX_GC_MAX_HEAP environment variables, sizes accept a K, M or G suffix.
+	struct GCConfig
+	{
+		// Heap size that triggers the first full collection.
+		size_t initialThreshold = DEFAULT_GC_INITIAL_THRESHOLD;
+		// The next collection runs once the heap reaches this multiple of what survived the last one.
+		double growFactor = DEFAULT_GC_GROW_FACTOR;
+		// Bounds of the collection threshold, so tiny heaps are not collected constantly.
+		size_t minHeap = DEFAULT_GC_INITIAL_THRESHOLD;
+		// Hard cap on the heap, 0 for none. An allocation past it runs an emergency full collection
+		// and fails with a runtime error if the heap still does not fit.
+		size_t maxHeap = 0;
+
+		static GCConfig FromEnvironment();
+		// The factor to use for a requested one, anything not finite and above 1.0 falls back to the default.
+		static double ValidGrowFactor(double factor);
+	};
+
+	// Collector telemetry since the last Reset. Counters are kept as the collector runs,
+	// the heap census is taken when the stats are read.
+	struct GCStats
+	{
+		static constexpr size_t PAUSE_BUCKETS = 24;
+
+		struct Collections
+		{
+			uint64_t count = 0;
+			// Bytes that survived and bytes freed by the last collection of this kind, and over all of them.
+			size_t lastMarkedBytes = 0;
+			size_t lastSweptBytes = 0;
+			uint64_t totalMarkedBytes = 0;
+			uint64_t totalSweptBytes = 0;
+		};
+		Collections minor;
+		Collections full;
+
+		// pauseHistogram[i] counts pauses shorter than 2^i microseconds, the last bucket also takes longer ones.
+		// Every slice of an incremental or lazily swept cycle is a pause of its own.
+		uint64_t pauseHistogram[PAUSE_BUCKETS] = {};
+		uint64_t pauseCount = 0;
+		uint64_t totalPauseNanos = 0;
+		uint64_t maxPauseNanos = 0;
+
+		uint64_t allocatedBytes = 0;
+		double elapsedSeconds = 0.0;
+
+		// Objects on the heap by type, including dead ones the sweep has not reached yet.
+		size_t heapBytes = 0;
+		size_t objectCounts[TYPE_ERROR + 1] = {};
+		size_t objectBytes[TYPE_ERROR + 1] = {};
+
+		double AllocationRate() const { return elapsedSeconds > 0.0 ? (double)allocatedBytes / elapsedSeconds : 0.0; }
+		std::string ToString() const;
+	};
+
+	// VM-internal heap objects, public so the object ops table can name them.
+	struct UpvalueValue : public VMObject
 	{
 		VMValue* location = nullptr;
 		VMValue closed;
@@ -55,11 +131,12 @@ protected:
 		{
 			type = TYPE_UPVALUE;
 		}
-		void Blacken(VM& vm) override;
-		size_t Size() const override { return sizeof(*this); }
+		void Blacken(VM& vm);
+		std::string ToString() const { return "<upvalue>"; }
+		size_t Size() const { return sizeof(*this); }
 	};
 
-	struct InnerValue : public Value
+	struct InnerValue : public VMObject
 	{
 		VMValue closure;
 		VMValue nextInner;
@@ -69,60 +146,117 @@ protected:
 		{
 			type = TYPE_INNER_VALUE;
 		}
-		void Blacken(VM& vm) override;
-		size_t Size() const override { return sizeof(*this); }
+		void Blacken(VM& vm);
+		std::string ToString() const { return "<inner>"; }
+		size_t Size() const { return sizeof(*this); }
 	};
 
+protected:
+
 	VMValue* stacks = nullptr;
 	size_t stackCapacity = 0;
 	VMValue* stackTop = nullptr;
 	UpvalueValue* openUpvalues = nullptr;
 
-	Value** grayStack = nullptr;
+	VMObject** grayStack = nullptr;
 	size_t grayStackCount = 0;
 	size_t grayStackCapacity = 0;
 
 	size_t bytesAllocated = 0;
-	size_t nextGC = INITIAL_GC_THRESHOLD;
+	GCConfig gcConfig = GCConfig::FromEnvironment();
+	size_t nextGC = DEFAULT_GC_INITIAL_THRESHOLD;
+
+	// Nursery, objects allocated since the last collection.
+	VMObject* youngObjects = nullptr;
+	size_t youngBytes = 0;
+	// Old objects that were given a reference to a young object, traced as roots by minor collections.
+	std::vector<VMObject*> rememberedSet;
+	// Set while a minor collection runs, marking then stops at old objects.
+	bool collectingYoung = false;
+
+	// Incremental full collections run in slices from AllocValue instead of stopping the world.
+	bool incrementalGC = false;
+	size_t gcSliceBytes = DEFAULT_GC_SLICE_BYTES;
+	GCPhase gcPhase = GC_PHASE_IDLE;
+	// Bytes allocated since the last slice.
+	size_t gcDebt = 0;
+	// Next object of the old generation to sweep and the last survivor before it.
+	VMObject* sweepCursor = nullptr;
+	VMObject* sweepPrevious = nullptr;
+	// Bumped whenever a closure some call site cached is freed, call caches filled in an older epoch miss.
+	uint64_t closureEpoch = 1;
+
+	GCStats gcStats;
+	std::chrono::steady_clock::time_point gcStatsStart;
+	// Collector entry points nest, only the outermost one times a pause.
+	uint32_t gcPauseDepth = 0;
+	std::chrono::steady_clock::time_point gcPauseStart;
+	// Bytes the sweep of the current cycle kept and freed so far.
+	size_t cycleMarkedBytes = 0;
+	size_t cycleSweptBytes = 0;
+
+	// Threads that trace the heap of a stop-the-world mark, 1 traces on the calling thread only.
+	size_t gcWorkerCount = 1;
+	size_t parallelMarkMinBytes = DEFAULT_PARALLEL_MARK_MIN_BYTES;
 
 	bool currentMarkValue = true;
 
+	// Weak set of every live string, lets equal strings share one object.
+	StringTable strings;
+	// Interned "init", a root so OP_METHOD can recognize initializers by pointer.
+	VMStringValue* initString = nullptr;
+
 	std::unordered_map<std::string, size_t> globalNameToSlot;
+	// Slot to name, only read when reporting an undefined global.
+	std::vector<std::string> globalNames;
+	// The compiler reserves slots up front, a slot holds an empty VMValue until its global is defined.
 	std::vector<VMValue> globalSlots;
 	std::vector<Compiler*> compilerRoots;
 
-	CallFrame frames[FRAMES_MAX];
+	// Grows by doubling, frames are reached by index so growth never rebases the value stack.
+	CallFrame* frames = nullptr;
+	uint32_t frameCapacity = 0;
 	uint32_t frameCount = 0;
+	// Hard limit on nested calls, exceeding it reports a stack overflow.
+	uint32_t maxFrames = DEFAULT_MAX_FRAMES;
 
 	// Stack operations
 	void ResetStack();
 	void AdjustFrameSlots(VMValue* oldStacks, VMValue* newStacks);
+	// Make room for slotCount more values above stackTop, rebasing frames if the buffer moves.
+	void EnsureStackCapacity(size_t slotCount);
 	void Push(VMValue value);
+	// Return the next free call frame, growing the frame array if needed. Returns nullptr past maxFrames.
+	CallFrame* PushFrame(const uint8_t* instructionIp);
 	InterpretResult Negate(const uint8_t* instructionIp = nullptr);
 	VMValue Pop();
 	VMValue Peek(int32_t distance);
+	// Empty when the heap cap refuses the new upvalue.
 	VMValue CaptureUpvalue(VMValue* local);
 	void CloseUpvalues(VMValue* last);
 
-	void FreeValue(Value* object);
-	Value* AllocValue(Value* value);
+	// Release an object that the caller has already unlinked from the objects list.
+	void FreeValue(VMObject* object);
+	VMObject* AllocValue(VMObject* value);
 
-	// Resolve a global variable slot by name, creating a new slot if it doesn't exist. Returns true on success.
-	bool ResolveOrCreateGlobalSlot(VMValue nameValue, size_t& outSlot, const uint8_t* instructionIp = nullptr);
-	// Resolve a global variable slot by name, returning false if it doesn't exist. Returns true on success.
-	bool ResolveExistingGlobalSlot(VMValue nameValue, size_t& outSlot, const uint8_t* instructionIp = nullptr);
+	// Return the slot of a global variable, reserving an undefined slot the first time the name is seen.
+	size_t ReserveGlobalSlot(const std::string& name);
 
 	static bool IsNumber(VMValue value);
 	static bool IsFalsey(VMValue value);
 	static bool IsString(VMValue value);
 
+	// Clamp a collection threshold to the configured heap bounds.
+	size_t ClampGCThreshold(size_t threshold) const;
+	// Report an allocation that did not fit under gcConfig.maxHeap.
+	void HeapLimitError(const uint8_t* instructionIp = nullptr);
+
 	void RuntimeError(const char* format, ...);
 	void RuntimeError(const uint8_t* instructionIp, const char* format, ...);
 	void RuntimeErrorImpl(const uint8_t* instructionIp, const char* format, va_list args);
 
 	void MarkRoots();
 	void MarkCompilerRoots();
-	void InvalidateInlineCaches();
 	void PushCompilerRoot(Compiler* compiler);
 	void PopCompilerRoot(Compiler* compiler);
 public:
@@ -139,22 +273,93 @@ public:
 	void Init();
 	void Reset();
 	void Free();
+	static VMValue Create(VMObject* object);
+	// Return the interned string with these contents, allocating it the first time.
+	static VMValue CreateString(std::string chars);
+	// Converts a tree-walk value: numbers, booleans and nil become immediates, strings are copied to the VM heap.
 	static VMValue Create(Value* value);
+	// Set the maximum call depth, takes effect on the next call.
+	void SetMaxFrames(uint32_t inMaxFrames);
+	uint32_t GetMaxFrames() const { return maxFrames; }
 
 	// Execution
 	InterpretResult Run();
 	// Call a function value with given argument count. Returns true on success.
 	bool Call(VMValue callee, int argCount, const uint8_t* instructionIp = nullptr);
+	// Call from tail position, a bytecode callee replaces the current frame instead of pushing a new one.
+	bool TailCall(VMValue callee, int argCount, const uint8_t* instructionIp = nullptr);
 	bool Invoke(VMValue receiver, VMValue method, int argCount, const uint8_t* instructionIp = nullptr);
-	bool InvokeClassMethod(VMValue classValue, const std::string& methodName, int argCount, const uint8_t* instructionIp = nullptr);
-	bool InvokeFromClass(VMValue classValue, VMValue receiver, const std::string& methodName, int argCount, uint32_t cacheIndex, const uint8_t* instructionIp = nullptr);
+	bool InvokeClassMethod(VMValue classValue, VMStringValue* methodName, int argCount, const uint8_t* instructionIp = nullptr);
+	bool InvokeFromClass(VMValue classValue, VMValue receiver, VMStringValue* methodName, int argCount, uint32_t cacheIndex, const uint8_t* instructionIp = nullptr);
+	// Store into a named field, adding it when the instance does not have it yet.
+	// The cache, if any, remembers the slot, or the shape transition for an added field.
+	// Returns false when adding the field would pass the heap cap.
+	bool StoreField(Compiler::VMInstanceValue* instance, VMStringValue* fieldName, VMValue value, InlineCache* cache);
 	InterpretResult Interpret(VMValue function);
 	InterpretResult Interpret(const char* source);
 
+	// Call after storing value into owner. Keeps the remembered set complete for minor collections
+	// and, while marking incrementally, keeps marked objects from pointing at unmarked ones.
+	inline void WriteBarrier(VMObject* owner, VMValue value)
+	{
+		if (!value.IsObject() || value.AsObject() == nullptr)
+		{
+			return;
+		}
+		VMObject* target = value.AsObject();
+		if (owner->isOld && !owner->isRemembered && !target->isOld)
+		{
+			owner->isRemembered = true;
+			rememberedSet.push_back(owner);
+		}
+		if (gcPhase == GC_PHASE_MARK && owner->markedValue == currentMarkValue && target->markedValue != currentMarkValue)
+		{
+			MarkValue(value);
+		}
+	}
+
+	// Make room for bytes more under gcConfig.maxHeap, collecting everything first if needed.
+	// Returns false when they still do not fit.
+	bool ReserveHeap(size_t bytes);
+	// Account for an object about to grow after it was allocated, so the heap size matches what freeing it gives back.
+	// Returns false when the growth would pass the heap cap, the object must then stay as it is.
+	bool ChargeGrowth(VMObject* object, size_t bytes);
+
 	void MarkValue(VMValue value);
 	void TraceReferences();
-	void Sweep();
+	// Drain the gray stack on gcWorkerCount threads with work-stealing queues.
+	void TraceReferencesParallel();
+	// Sweep old objects from sweepCursor until budget bytes were visited, returns the bytes visited.
+	size_t SweepStep(size_t budget);
+	// Free unmarked nursery objects and promote the rest, returns the bytes promoted.
+	size_t SweepYoung();
+	void PromoteYoung();
+	void ClearRememberedSet();
+	// Full collection of both generations, marks in one pause and leaves the sweep to later allocations.
 	void CollectGarbage();
+	void BeginGCPause();
+	void EndGCPause();
+	// Full collection that also finishes its sweep, used when the heap cap is hit.
+	void CollectAllGarbage();
+	// Minor collection of the nursery only.
+	void CollectYoungGarbage();
+	// Incremental full collection: gray the roots, then trace and sweep in bounded slices.
+	void StartGCCycle();
+	void GCSlice(size_t budget);
+	void FinishMarking();
+	// Enter the sweep phase, later allocations then free the unmarked old objects in slices.
+	void StartSweep();
+	void FinishGCCycle();
+	// Switch full collections between stop-the-world and incremental slices of about sliceBytes of work.
+	void SetIncrementalGC(bool enabled, size_t sliceBytes = DEFAULT_GC_SLICE_BYTES);
+	// Trace with workerCount threads once the traced generation reaches minHeapBytes.
+	void SetGCWorkerCount(size_t workerCount, size_t minHeapBytes = DEFAULT_PARALLEL_MARK_MIN_BYTES);
+
+	// Replace the heap sizing, the cap applies to the next allocation and the thresholds to the next collection.
+	void SetGCConfig(const GCConfig& config);
+	const GCConfig& GetGCConfig() const { return gcConfig; }
+	// Snapshot of the collector counters together with a census of the heap.
+	GCStats GetGCStats() const;
 
 	void DefineNative(const std::string& name, Compiler::NativeFn function, int32_t arity);
 
@@ -1,7 +1,10 @@
 #pragma once
+#include <atomic>
 #include <memory>
 #include <string>
+#include <utility>
 #include "Lox.h" // Lox runtime error reporting interface
+#include "ValueArena.h"
 
 enum ValueType
 {
@@ -29,8 +32,6 @@ typedef std::shared_ptr<Value> ValuePtr;
 struct Value : public std::enable_shared_from_this<Value>
 {
 	ValueType type;
-	bool markedValue = false;
-	Value* nextGCValue = nullptr;
 	virtual ~Value() = default;
 
 	Value() : type(TYPE_ERROR) {}
@@ -46,11 +47,82 @@ struct Value : public std::enable_shared_from_this<Value>
 	virtual operator float() const { Lox::GetInstance().RuntimeError("Invalid conversion to float."); return 0.0f; }
 	virtual operator bool() const { Lox::GetInstance().RuntimeError("Invalid conversion to bool."); return false; }
 	virtual operator std::string() const { Lox::GetInstance().RuntimeError("Invalid conversion to string."); return ""; }
-	virtual Chunk* GetChunk() const { return nullptr; }
-	virtual void Blacken(VM& vm) { (void)vm; }
 	virtual size_t Size() const = 0;
 };
 
+// --- VM heap objects ---
+
+// Header of every object the VM allocates. It has no vtable and no shared ownership, so the VM
+// frees objects itself and looks per-type behavior up in vmObjectOps by the type tag.
+struct VMObject
+{
+	ValueType type = TYPE_ERROR;
+	// Atomic so parallel markers can claim an object exactly once.
+	std::atomic<bool> markedValue{ false };
+	// Survived a collection and moved to the old generation.
+	bool isOld = false;
+	// Old object already queued in the VM's remembered set.
+	bool isRemembered = false;
+	VMObject* nextGCValue = nullptr;
+
+	VMObject() = default;
+
+	// Objects live in the size-class arena, deleting through the concrete type supplies the real size.
+	static void* operator new(size_t size) { return ValueArena::GetInstance().Allocate(size); }
+	static void operator delete(void* pointer, size_t size) { ValueArena::GetInstance().Free(pointer, size); }
+
+	VMObject& operator=(const VMObject& other) = delete;
+	VMObject(const VMObject& other) = delete;
+};
+
+static_assert(sizeof(VMObject) <= 2 * sizeof(void*), "VMObject header should stay within two words");
+
+// Per-type behavior of VM objects, indexed by ValueType.
+struct VMObjectOps
+{
+	void (*blacken)(VM& vm, VMObject* object);
+	size_t (*size)(const VMObject* object);
+	Chunk* (*chunk)(const VMObject* object);
+	std::string (*toString)(const VMObject* object);
+	void (*destroy)(VMObject* object);
+};
+
+// Defined by the VM, entries for immediate types are empty.
+extern const VMObjectOps vmObjectOps[TYPE_ERROR + 1];
+
+inline void BlackenObject(VM& vm, VMObject* object) { vmObjectOps[object->type].blacken(vm, object); }
+inline size_t ObjectSize(const VMObject* object) { return vmObjectOps[object->type].size(object); }
+inline Chunk* ObjectChunk(const VMObject* object) { return vmObjectOps[object->type].chunk(object); }
+inline std::string ObjectToString(const VMObject* object) { return vmObjectOps[object->type].toString(object); }
+inline void DestroyObject(VMObject* object) { vmObjectOps[object->type].destroy(object); }
+
+// FNV-1a, computed once per string when it is interned.
+inline uint32_t HashString(const char* chars, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= (uint8_t)chars[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Every VM string is interned, see VM::CreateString, so equal strings are the same object.
+struct VMStringValue : public VMObject
+{
+	std::string value;
+	uint32_t hash;
+	VMStringValue(std::string inValue, uint32_t inHash)
+		: value(std::move(inValue))
+		, hash(inHash)
+	{
+		type = TYPE_STRING;
+	}
+	std::string ToString() const { return value; }
+	size_t Size() const { return sizeof(*this) + value.capacity(); }
+};
+
 // --- Concrete Value types ---
 
 struct ErrorValue : public Value
@@ -120,8 +192,6 @@ struct FloatValue : public Value
 struct StringValue : public Value
 {
 	std::string value;
-	// Cache for global variable slot index to optimize global variable access. Updated by the VM when a global variable is defined.
-	size_t cachedGlobalSlot = (size_t)-1;
 	static Value* CreateRaw(const std::string& inValue)
 	{
 		auto val = new StringValue();
@@ -195,6 +265,8 @@ inline const char* ValueTypeToString(ValueType type)
 		case TYPE_CLASS:    return "Class";
 		case TYPE_INSTANCE: return "Instance";
 		case TYPE_UPVALUE:  return "Upvalue";
+		case TYPE_BOUND_METHOD: return "BoundMethod";
+		case TYPE_INNER_VALUE:  return "Inner";
 		case TYPE_ERROR:    return "Error";
 		default:            return "Unknown";
 	}
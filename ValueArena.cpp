@@ -0,0 +1,139 @@
+#include "ValueArena.h"
+#include <new>
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+void* ValueArena::Allocate(size_t size)
+{
+	if (size == 0 || size > MAX_SMALL_SIZE)
+	{
+		return ::operator new(size);
+	}
+
+	size_t sizeClass = SizeClass(size);
+	Page* page = availablePages[sizeClass];
+	if (page == nullptr)
+	{
+		page = NewPage(sizeClass);
+	}
+
+	void* cell;
+	if (page->freeList != nullptr)
+	{
+		cell = page->freeList;
+		page->freeList = page->freeList->next;
+	}
+	else
+	{
+		// Untouched cells are handed out in address order.
+		cell = Cells(page) + page->bumpIndex * CellSize(sizeClass);
+		++page->bumpIndex;
+	}
+	if (++page->liveCount == page->cellCount)
+	{
+		UnlinkAvailable(page);
+	}
+	return cell;
+}
+
+void ValueArena::Free(void* pointer, size_t size)
+{
+	if (pointer == nullptr)
+	{
+		return;
+	}
+	if (size == 0 || size > MAX_SMALL_SIZE)
+	{
+		::operator delete(pointer);
+		return;
+	}
+
+	Page* page = PageOf(pointer);
+	if (page->liveCount == page->cellCount)
+	{
+		LinkAvailable(page);
+	}
+	// Freed cells go to the front of the page's list so the next allocation reuses warm memory.
+	FreeCell* cell = static_cast<FreeCell*>(pointer);
+	cell->next = page->freeList;
+	page->freeList = cell;
+
+	// Keep the last available page of a class, a class that empties and refills in a loop
+	// would otherwise get and release a page every time.
+	if (--page->liveCount == 0 && (page->previous != nullptr || page->next != nullptr))
+	{
+		UnlinkAvailable(page);
+		ReleasePage(page);
+	}
+}
+
+ValueArena::Page* ValueArena::NewPage(size_t sizeClass)
+{
+	void* memory = nullptr;
+#ifdef _WIN32
+	memory = _aligned_malloc(PAGE_SIZE, PAGE_SIZE);
+#else
+	if (posix_memalign(&memory, PAGE_SIZE, PAGE_SIZE) != 0)
+	{
+		memory = nullptr;
+	}
+#endif
+	if (memory == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	Page* page = static_cast<Page*>(memory);
+	page->freeList = nullptr;
+	page->bumpIndex = 0;
+	page->cellCount = (uint32_t)((PAGE_SIZE - PAGE_HEADER_SIZE) / CellSize(sizeClass));
+	page->liveCount = 0;
+	page->sizeClass = (uint32_t)sizeClass;
+	page->previous = nullptr;
+	page->next = nullptr;
+	LinkAvailable(page);
+	++pageCount;
+	return page;
+}
+
+void ValueArena::ReleasePage(Page* page)
+{
+#ifdef _WIN32
+	_aligned_free(page);
+#else
+	free(page);
+#endif
+	--pageCount;
+}
+
+void ValueArena::LinkAvailable(Page* page)
+{
+	Page*& head = availablePages[page->sizeClass];
+	page->previous = nullptr;
+	page->next = head;
+	if (head != nullptr)
+	{
+		head->previous = page;
+	}
+	head = page;
+}
+
+void ValueArena::UnlinkAvailable(Page* page)
+{
+	if (page->previous != nullptr)
+	{
+		page->previous->next = page->next;
+	}
+	else
+	{
+		availablePages[page->sizeClass] = page->next;
+	}
+	if (page->next != nullptr)
+	{
+		page->next->previous = page->previous;
+	}
+	page->previous = nullptr;
+	page->next = nullptr;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Page based allocator behind VMObject's operator new/delete.
+// Small requests are rounded up to a size class and served from pages of that class, so objects
+// of similar size end up next to each other. Every page counts its live cells and goes back to the
+// system once the last of them is freed, so a spike in one class does not keep its memory.
+// Larger requests go straight to the global allocator.
+class ValueArena
+{
+public:
+	static constexpr size_t GRANULARITY = 16;
+	static constexpr size_t MAX_SMALL_SIZE = 512;
+	static constexpr size_t CLASS_COUNT = MAX_SMALL_SIZE / GRANULARITY;
+	// Pages are aligned to their size, a cell finds its page by masking its address.
+	static constexpr size_t PAGE_SIZE = 64 * 1024;
+
+	static ValueArena& GetInstance()
+	{
+		// Never destroyed, values owned by static objects may still be freed during exit.
+		static ValueArena* instance = new ValueArena();
+		return *instance;
+	}
+
+	void* Allocate(size_t size);
+	void Free(void* pointer, size_t size);
+
+	size_t GetPageCount() const { return pageCount; }
+protected:
+	struct FreeCell
+	{
+		FreeCell* next;
+	};
+
+	// Sits at the start of every page, the cells follow it.
+	struct Page
+	{
+		FreeCell* freeList;
+		// Cells below this index that were never handed out are not on freeList.
+		uint32_t bumpIndex;
+		uint32_t cellCount;
+		uint32_t liveCount;
+		uint32_t sizeClass;
+		// Links in the class's list of pages that still have a free cell.
+		Page* previous;
+		Page* next;
+	};
+	static constexpr size_t PAGE_HEADER_SIZE = (sizeof(Page) + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+
+	Page* availablePages[CLASS_COUNT] = {};
+	size_t pageCount = 0;
+
+	static size_t SizeClass(size_t size) { return (size + GRANULARITY - 1) / GRANULARITY - 1; }
+	static size_t CellSize(size_t sizeClass) { return (sizeClass + 1) * GRANULARITY; }
+	static Page* PageOf(void* pointer) { return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(pointer) & ~(uintptr_t)(PAGE_SIZE - 1)); }
+	static char* Cells(Page* page) { return reinterpret_cast<char*>(page) + PAGE_HEADER_SIZE; }
+
+	Page* NewPage(size_t sizeClass);
+	void ReleasePage(Page* page);
+	void LinkAvailable(Page* page);
+	void UnlinkAvailable(Page* page);
+};